@@ -14,6 +14,9 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/gfp.h>
+#include <linux/delay.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
 #include <sound/initval.h>
 #include <sound/core.h>
 #include <linux/usb.h>
@@ -21,6 +24,7 @@
 #include "chip.h"
 #include "pcm.h"
 #include "midi.h"
+#include "recorder.h"
 
 MODULE_AUTHOR("Marcel Bierling <marcel@hackerman.art>");
 MODULE_DESCRIPTION("Allen&Heath Xone:DB4/DB2 driver");
@@ -30,12 +34,17 @@ static int index[SNDRV_CARDS] = SNDRV_DEFAULT_IDX;
 static char *id[SNDRV_CARDS] = SNDRV_DEFAULT_STR;
 static bool enable[SNDRV_CARDS] = SNDRV_DEFAULT_ENABLE_PNP;
 
-int cardindex;
-bool justresetting = false;
-
 #define DRIVER_NAME "snd-usb-xonedb4"
 
+#define XDB4_CLOCK_LOCK_TIMEOUT_MS	500
+#define XDB4_CLOCK_LOCK_POLL_US		2000
+#define XDB4_SET_RATE_ATTEMPTS		3
+
+/* the rate goes to the IN (EP 6) and OUT (EP 5) streaming endpoints */
+static const u16 samplerate_endpoints[] = { 0x0086, 0x0005 };
+
 static DEFINE_MUTEX(register_mutex);
+static struct xonedb4_chip *chips[SNDRV_CARDS]; /* protected by register_mutex */
 
 int xonedb4_get_firmware_ver(struct xonedb4_chip *chip)
 {
@@ -65,25 +74,9 @@ int xonedb4_send_resets(struct xonedb4_chip *chip)
 	return ret;
 }
 
-int xonedb4_reset(struct xonedb4_chip *chip)
-{
-	dev_notice(&chip->dev->dev, "%s: Resetting device", __func__);
-
-	int ret;
-
-	justresetting = true;
-
-	ret = usb_reset_device(chip->dev);
-	if (ret < 0) {
-		dev_err(&chip->dev->dev, "%s: Reset failed!\n", __func__);
-		return ret;
-	}
-
-	return 0;
-}
-
 int xonedb4_set_samplerate(struct xonedb4_chip *chip)
 {
+	int i;
 	int ret;
 
 	switch (chip->alsarate)
@@ -113,26 +106,12 @@ int xonedb4_set_samplerate(struct xonedb4_chip *chip)
 			return -1;
 	}
 	
-	// set samplerate
-	ret = usb_control_msg(chip->dev, usb_sndctrlpipe(chip->dev, 0), 0x01, 0x22, 0x0100, 0x0086, chip->sampleratebytes, 3, 2000);
-	if (ret < 0) {
-		return ret;
-	}
-	ret = usb_control_msg(chip->dev, usb_sndctrlpipe(chip->dev, 0), 0x01, 0x22, 0x0100, 0x0005, chip->sampleratebytes, 3, 2000);
-	if (ret < 0) {
-		return ret;
-	}
-	ret = usb_control_msg(chip->dev, usb_sndctrlpipe(chip->dev, 0), 0x01, 0x22, 0x0100, 0x0086, chip->sampleratebytes, 3, 2000);
-	if (ret < 0) {
-		return ret;
-	}
-	ret = usb_control_msg(chip->dev, usb_sndctrlpipe(chip->dev, 0), 0x01, 0x22, 0x0100, 0x0005, chip->sampleratebytes, 3, 2000);
-	if (ret < 0) {
-		return ret;
-	}
-	ret = usb_control_msg(chip->dev, usb_sndctrlpipe(chip->dev, 0), 0x01, 0x22, 0x0100, 0x0086, chip->sampleratebytes, 3, 2000);
-	if (ret < 0) {
-		return ret;
+	// set samplerate on both streaming endpoints
+	for (i = 0; i < ARRAY_SIZE(samplerate_endpoints); i++) {
+		ret = usb_control_msg(chip->dev, usb_sndctrlpipe(chip->dev, 0), 0x01, 0x22, 0x0100, samplerate_endpoints[i], chip->sampleratebytes, 3, 2000);
+		if (ret < 0) {
+			return ret;
+		}
 	}
 
 	chip->devicerate = chip->alsarate;
@@ -142,6 +121,25 @@ int xonedb4_set_samplerate(struct xonedb4_chip *chip)
 	return ret;
 }
 
+static int xonedb4_parse_samplerate(struct xonedb4_chip *chip)
+{
+	dev_dbg(&chip->dev->dev, "%s: Got hardware samplerate: %02X%02X%02X\n", __func__, chip->sampleratebytes[0], chip->sampleratebytes[1], chip->sampleratebytes[2]);
+
+	if ((chip->sampleratebytes[0] == 0x44) && (chip->sampleratebytes[1] == 0xAC) && (chip->sampleratebytes[2] == 0x00)) {
+		chip->devicerate = 0;
+	} else if ((chip->sampleratebytes[0] == 0x80) && (chip->sampleratebytes[1] == 0xBB) && (chip->sampleratebytes[2] == 0x00)) {
+		chip->devicerate = 1;
+	} else if ((chip->sampleratebytes[0] == 0x88) && (chip->sampleratebytes[1] == 0x58) && (chip->sampleratebytes[2] == 0x01)) {
+		chip->devicerate = 2;
+	} else if ((chip->sampleratebytes[0] == 0x00) && (chip->sampleratebytes[1] == 0x77) && (chip->sampleratebytes[2] == 0x01)) {
+		chip->devicerate = 3;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
 int xonedb4_get_status(struct xonedb4_chip *chip)
 {
 	int ret;
@@ -161,21 +159,231 @@ int xonedb4_get_samplerate(struct xonedb4_chip *chip)
 	if (ret < 0) {
 		return ret;
 	}
-	dev_dbg(&chip->dev->dev, "%s: Got hardware samplerate: %02X%02X%02X\n", __func__, chip->sampleratebytes[0], chip->sampleratebytes[1], chip->sampleratebytes[2]);
 
-	if ((chip->sampleratebytes[0] == 0x44) && (chip->sampleratebytes[1] == 0xAC) && (chip->sampleratebytes[2] == 0x00)) {
-		chip->devicerate = 0;
-	} else if ((chip->sampleratebytes[0] == 0x80) && (chip->sampleratebytes[1] == 0xBB) && (chip->sampleratebytes[2] == 0x00)) {
-		chip->devicerate = 1;
-	} else if ((chip->sampleratebytes[0] == 0x88) && (chip->sampleratebytes[1] == 0x58) && (chip->sampleratebytes[2] == 0x01)) {
-		chip->devicerate = 2;
-	} else if ((chip->sampleratebytes[0] == 0x00) && (chip->sampleratebytes[1] == 0x77) && (chip->sampleratebytes[2] == 0x01)) {
-		chip->devicerate = 3;
-	} else {
-		return -1;
+	return xonedb4_parse_samplerate(chip);
+}
+
+/* polls the status request until the device reports a stable, locked clock */
+int xonedb4_wait_clock_lock(struct xonedb4_chip *chip)
+{
+	unsigned long timeout = jiffies + msecs_to_jiffies(XDB4_CLOCK_LOCK_TIMEOUT_MS);
+	int ret;
+
+	do {
+		ret = xonedb4_get_status(chip);
+		if (ret < 0) {
+			return ret;
+		}
+		if ((chip->status[0] & XDB4_STATUS_LOCKED) == XDB4_STATUS_LOCKED) {
+			return 0;
+		}
+		usleep_range(XDB4_CLOCK_LOCK_POLL_US, XDB4_CLOCK_LOCK_POLL_US * 2);
+	} while (time_before(jiffies, timeout));
+
+	return -ETIMEDOUT;
+}
+
+/* switches the device to chip->alsarate while it stays enumerated, PCM URBs must be stopped */
+int xonedb4_switch_samplerate(struct xonedb4_chip *chip)
+{
+	int attempt;
+	int ret;
+
+	for (attempt = 0; attempt < XDB4_SET_RATE_ATTEMPTS; attempt++) {
+		ret = xonedb4_set_samplerate(chip);
+		if (ret < 0) {
+			return ret;
+		}
+
+		ret = xonedb4_wait_clock_lock(chip);
+		if (ret == -ETIMEDOUT) {
+			dev_warn(&chip->dev->dev, "%s: No clock lock reported (status %02X), continuing\n", __func__, chip->status[0]);
+		} else if (ret < 0) {
+			return ret;
+		}
+
+		ret = xonedb4_get_samplerate(chip);
+		if (ret < 0) {
+			return ret;
+		}
+		if (chip->devicerate == chip->alsarate) {
+			return 0;
+		}
 	}
 
-	return ret;
+	dev_err(&chip->dev->dev, "%s: Device did not take the new samplerate!\n", __func__);
+	return -EIO;
+}
+
+static void xonedb4_query_complete(struct urb *urb)
+{
+	int *status = urb->context;
+
+	*status = urb->status;
+}
+
+/* firmware, status and samplerate don't depend on each other, so they go out back to back */
+static int xonedb4_query_device(struct xonedb4_chip *chip)
+{
+	const struct {
+		u8 request;
+		u8 requesttype;
+		u16 value;
+		void *data;
+		u16 size;
+	} reads[] = {
+		{ 0x56, 0xC0, 0x0000, chip->firmwarever, sizeof(chip->firmwarever) },
+		{ 0x49, 0xC0, 0x0000, chip->status, sizeof(chip->status) },
+		{ 0x81, 0xA2, 0x0100, chip->sampleratebytes, sizeof(chip->sampleratebytes) },
+	};
+	int status[ARRAY_SIZE(reads)];
+	u8 *buf[ARRAY_SIZE(reads)] = { NULL }; /* one DMA-safe allocation per transfer, the chip fields share a cacheline */
+	struct usb_ctrlrequest *setup;
+	struct usb_anchor anchor;
+	struct urb *urb;
+	int i;
+	int ret = 0;
+
+	setup = kcalloc(ARRAY_SIZE(reads), sizeof(*setup), GFP_KERNEL);
+	if (!setup) {
+		return -ENOMEM;
+	}
+
+	init_usb_anchor(&anchor);
+
+	for (i = 0; i < ARRAY_SIZE(reads); i++) {
+		status[i] = -EINPROGRESS;
+
+		buf[i] = kmalloc(reads[i].size, GFP_KERNEL);
+		if (!buf[i]) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		setup[i].bRequestType = reads[i].requesttype;
+		setup[i].bRequest = reads[i].request;
+		setup[i].wValue = cpu_to_le16(reads[i].value);
+		setup[i].wIndex = 0;
+		setup[i].wLength = cpu_to_le16(reads[i].size);
+
+		usb_fill_control_urb(urb, chip->dev, usb_rcvctrlpipe(chip->dev, 0), (unsigned char *)&setup[i], buf[i], reads[i].size, xonedb4_query_complete, &status[i]);
+		usb_anchor_urb(urb, &anchor);
+		ret = usb_submit_urb(urb, GFP_KERNEL);
+		if (ret < 0) {
+			usb_unanchor_urb(urb);
+		}
+		usb_free_urb(urb);
+		if (ret < 0) {
+			break;
+		}
+	}
+
+	if (!usb_wait_anchor_empty_timeout(&anchor, 2000)) {
+		usb_kill_anchored_urbs(&anchor);
+		ret = -ETIMEDOUT;
+	}
+	kfree(setup);
+
+	for (i = 0; ret == 0 && i < ARRAY_SIZE(reads); i++) {
+		if (status[i] < 0) {
+			ret = status[i];
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(reads); i++) {
+		if (ret == 0) {
+			memcpy(reads[i].data, buf[i], reads[i].size);
+		}
+		kfree(buf[i]);
+	}
+	if (ret < 0) {
+		return ret;
+	}
+
+	return xonedb4_parse_samplerate(chip);
+}
+
+static bool xonedb4_samplerate_differs(struct xonedb4_chip *chip)
+{
+	return chip->devicerate != chip->alsarate;
+}
+
+static bool xonedb4_clock_unlocked(struct xonedb4_chip *chip)
+{
+	return (chip->status[0] & XDB4_STATUS_LOCKED) != XDB4_STATUS_LOCKED;
+}
+
+struct xonedb4_init_step {
+	const char *name;
+	int (*run)(struct xonedb4_chip *chip);
+	bool (*needed)(struct xonedb4_chip *chip); /* NULL if always needed */
+	bool may_time_out; /* a timeout only warns */
+};
+
+/* bring-up sequence, shared by probe, reset and samplerate changes */
+static const struct xonedb4_init_step init_sequence[] = {
+	{ "query device", xonedb4_query_device, NULL, false },
+	{ "switch samplerate", xonedb4_switch_samplerate, xonedb4_samplerate_differs, false },
+	{ "wait for clock lock", xonedb4_wait_clock_lock, xonedb4_clock_unlocked, true },
+	{ "send allgood", xonedb4_send_allgood, NULL, false },
+};
+
+int xonedb4_init_device(struct xonedb4_chip *chip)
+{
+	ktime_t start, step_start;
+	int i;
+	int ret;
+
+	start = ktime_get();
+
+	for (i = 0; i < ARRAY_SIZE(init_sequence); i++) {
+		if (init_sequence[i].needed && !init_sequence[i].needed(chip)) {
+			dev_dbg(&chip->dev->dev, "%s: %s: skipped\n", __func__, init_sequence[i].name);
+			continue;
+		}
+
+		step_start = ktime_get();
+		ret = init_sequence[i].run(chip);
+		if (ret == -ETIMEDOUT && init_sequence[i].may_time_out) {
+			dev_warn(&chip->dev->dev, "%s: %s timed out (status %02X), continuing\n", __func__, init_sequence[i].name, chip->status[0]);
+			ret = 0;
+		}
+		if (ret < 0) {
+			dev_err(&chip->dev->dev, "%s: %s failed: %d\n", __func__, init_sequence[i].name, ret);
+			return ret;
+		}
+		dev_dbg(&chip->dev->dev, "%s: %s: %lld us\n", __func__, init_sequence[i].name, ktime_us_delta(ktime_get(), step_start));
+	}
+
+	chip->init_us = ktime_us_delta(ktime_get(), start);
+	dev_dbg(&chip->dev->dev, "%s: Device ready after %lld us\n", __func__, chip->init_us);
+
+	return 0;
+}
+
+/* the card's last user is gone, disconnect or the probe error path stopped the device before */
+static void xonedb4_card_free(struct snd_card *card)
+{
+	struct xonedb4_chip *chip = card->private_data;
+
+	xonedb4_pcm_free(chip);
+}
+
+/* frees the card slot, the card itself goes away once userspace closed it */
+static void xonedb4_release_card(struct xonedb4_chip *chip)
+{
+	mutex_lock(&register_mutex);
+	chips[chip->regidx] = NULL;
+	mutex_unlock(&register_mutex);
+
+	snd_card_disconnect(chip->card);
+	snd_card_free_when_closed(chip->card);
 }
 
 /* In case of the Xone DB4, this actually gets called twice as the device announced 2 interfaces */
@@ -206,67 +414,13 @@ static int xonedb4_probe(struct usb_interface *intf, const struct usb_device_id
 		return -EIO;
 	}
 
-	if (justresetting == true) {
-		card = snd_card_ref(cardindex);
-		chip = card->private_data;
-		chip->card = card;
-		chip->dev = device;
-		justresetting = false;
-	
-		// get status
-		ret = xonedb4_get_status(chip);
-		if (ret < 0) {
-			goto err_chip_destroy;
-		}
-		// get samplerate
-		ret = xonedb4_get_samplerate(chip);
-		if (ret < 0) {
-			goto err_chip_destroy;
-		}
-		// set samplerate
-		ret = xonedb4_set_samplerate(chip);
-		if (ret < 0) {
-			goto err_chip_destroy;
-		}
-		// get samplerate
-		ret = xonedb4_get_samplerate(chip);
-		if (ret < 0) {
-			goto err_chip_destroy;
-		}
-		// get status
-		ret = xonedb4_get_status(chip);
-		if (ret < 0) {
-			goto err_chip_destroy;
-		}
-		// send allgood
-		ret = xonedb4_send_allgood(chip);
-		if (ret < 0) {
-			goto err_chip_destroy;
-		}
-
-		ret = xonedb4_midi_init_bulk_urbs(chip);
-		if (ret < 0) {
-			dev_err(&device->dev, "%s: MIDI fail!\n", __func__);
-			goto err_chip_destroy;
-		}
-		ret = xonedb4_pcm_init_urbs(chip);
-		if (ret < 0) {
-			dev_err(&device->dev, "%s: PCM fail!\n", __func__);
-			goto err_chip_destroy;
-		}
-
-		usb_set_intfdata(intf, chip);
+	mutex_lock(&register_mutex);
 
-		return 0;
-	}
-	
 	dev_info(&device->dev, "%s: Found device: %s\n", __func__, device->product);
 
-	mutex_lock(&register_mutex);
-
-	/* see if the soundcard is already created */
+	/* find a free card slot */
 	for (i = 0; i < SNDRV_CARDS; i++) {
-		if (enable[i]) {
+		if (enable[i] && !chips[i]) {
 			break;
 		}
 	}
@@ -276,61 +430,32 @@ static int xonedb4_probe(struct usb_interface *intf, const struct usb_device_id
 		goto err;
 	}
 
-	mutex_unlock(&register_mutex);
-				
 	ret = snd_card_new(&intf->dev, index[i], id[i], THIS_MODULE, sizeof(struct xonedb4_chip), &card);
 	if (ret < 0) {
 		dev_err(&device->dev, "%s: Cannot create ALSA card!\n", __func__);
-		return ret;
+		goto err;
 	}
 
-	cardindex = card->number;
-
 	strscpy(card->driver, DRIVER_NAME, sizeof(card->driver));
 	strscpy(card->shortname, device->product, sizeof(card->shortname));
 	sprintf(card->longname, "%s at %d:%d", card->shortname, device->bus->busnum, device->devnum);
 
 	chip = card->private_data;
 	chip->card = card;
+	card->private_free = xonedb4_card_free;
 	chip->dev = device;
+	chip->regidx = i;
 
 	chip->alsarate = 3;
 
-	/* get firmware */
-	ret = xonedb4_get_firmware_ver(chip);
+	ret = xonedb4_init_device(chip);
 	if (ret < 0) {
-		goto err;
+		goto err_chip_destroy;
 	}
 
-	dev_info(&device->dev, "%s: Ploytec firmware version: 1.%d.%d\n", __func__, chip->firmwarever[2]/10, chip->firmwarever[2]%10);
+	dev_info(&device->dev, "%s: Ploytec firmware version: 1.%d.%d, ready after %lld us\n", __func__, chip->firmwarever[2]/10, chip->firmwarever[2]%10, chip->init_us);
 
-	// get status
-	ret = xonedb4_get_status(chip);
-	if (ret < 0) {
-		goto err_chip_destroy;
-	}
-	// get samplerate
-	ret = xonedb4_get_samplerate(chip);
-	if (ret < 0) {
-		goto err_chip_destroy;
-	}
-	// set samplerate
-	ret = xonedb4_set_samplerate(chip);
-	if (ret < 0) {
-		goto err_chip_destroy;
-	}
-	// get samplerate
-	ret = xonedb4_get_samplerate(chip);
-	if (ret < 0) {
-		goto err_chip_destroy;
-	}
-	// get status
-	ret = xonedb4_get_status(chip);
-	if (ret < 0) {
-		goto err_chip_destroy;
-	}
-	// send allgood
-	ret = xonedb4_send_allgood(chip);
+	ret = xonedb4_recorder_init(chip);
 	if (ret < 0) {
 		goto err_chip_destroy;
 	}
@@ -350,10 +475,17 @@ static int xonedb4_probe(struct usb_interface *intf, const struct usb_device_id
 		goto err_chip_destroy;
 	}
 
+	chips[i] = chip;
+	mutex_unlock(&register_mutex);
+
 	usb_set_intfdata(intf, chip);
 	return 0;
 
 err_chip_destroy:
+	/* the idle URB, its keepalive and the MIDI IN URBs may already be running */
+	xonedb4_pcm_abort(chip);
+	xonedb4_midi_stop_urbs(chip);
+	xonedb4_recorder_free(chip);
 	snd_card_free(chip->card);
 err:
 	mutex_unlock(&register_mutex);
@@ -368,21 +500,98 @@ static void xonedb4_disconnect(struct usb_interface *intf)
 	}
 
 	struct xonedb4_chip *chip;
-	struct snd_card *card;
 
 	chip = usb_get_intfdata(intf);
 	if (!chip)
 		return;
 
-	card = chip->card;
-
 	/* Make sure that the userspace cannot create new request */
 	xonedb4_pcm_abort(chip);
 	xonedb4_midi_abort(chip);
-	if (justresetting == false) {
-		snd_card_disconnect(chip->card);
-		snd_card_free_when_closed(chip->card);
+	xonedb4_recorder_free(chip);
+	xonedb4_release_card(chip);
+}
+
+/* brings the device back up after a resume or reset, the card and its streams stay */
+static int xonedb4_restart(struct xonedb4_chip *chip)
+{
+	int ret;
+
+	ret = xonedb4_init_device(chip);
+	if (ret < 0) {
+		return ret;
 	}
+
+	ret = xonedb4_midi_start_urbs(chip);
+	if (ret < 0) {
+		dev_err(&chip->dev->dev, "%s: MIDI fail!\n", __func__);
+		return ret;
+	}
+
+	return xonedb4_pcm_start_urbs(chip);
+}
+
+static int xonedb4_suspend(struct usb_interface *intf, pm_message_t message)
+{
+	struct xonedb4_chip *chip = usb_get_intfdata(intf);
+
+	if (!chip)
+		return 0;
+
+	snd_power_change_state(chip->card, SNDRV_CTL_POWER_D3hot);
+	xonedb4_pcm_suspend(chip);
+	xonedb4_midi_stop_urbs(chip);
+
+	return 0;
+}
+
+/* also used for reset_resume, the bring-up sequence restores the samplerate either way */
+static int xonedb4_resume(struct usb_interface *intf)
+{
+	struct xonedb4_chip *chip = usb_get_intfdata(intf);
+	int ret;
+
+	if (!chip)
+		return 0;
+
+	ret = xonedb4_restart(chip);
+	if (ret < 0) {
+		dev_err(&chip->dev->dev, "%s: Resume failed!\n", __func__);
+	}
+
+	snd_power_change_state(chip->card, SNDRV_CTL_POWER_D0);
+
+	return ret;
+}
+
+static int xonedb4_pre_reset(struct usb_interface *intf)
+{
+	struct xonedb4_chip *chip = usb_get_intfdata(intf);
+
+	if (!chip)
+		return 0;
+
+	xonedb4_pcm_stop_urbs(chip);
+	xonedb4_midi_stop_urbs(chip);
+
+	return 0;
+}
+
+/* a failure here makes the USB core unbind and probe us again */
+static int xonedb4_post_reset(struct usb_interface *intf)
+{
+	struct xonedb4_chip *chip = usb_get_intfdata(intf);
+	int ret;
+
+	if (!chip)
+		return 0;
+
+	ret = xonedb4_restart(chip);
+	if (ret < 0) {
+		dev_err(&chip->dev->dev, "%s: Restart after reset failed!\n", __func__);
+	}
+
+	return ret;
 }
 
 static const struct usb_device_id device_table[] = {
@@ -425,6 +634,11 @@ static struct usb_driver snd_xonedb4_driver = {
 	.name 		= "snd-usb-xonedb4",
 	.probe 		= xonedb4_probe,
 	.disconnect = xonedb4_disconnect,
+	.suspend	= xonedb4_suspend,
+	.resume		= xonedb4_resume,
+	.reset_resume = xonedb4_resume,
+	.pre_reset	= xonedb4_pre_reset,
+	.post_reset	= xonedb4_post_reset,
 	.id_table   = device_table,
 };
 
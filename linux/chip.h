@@ -5,6 +5,13 @@
 #include <sound/core.h>
 
 struct pcm_runtime;
+struct xonedb4_recorder;
+
+/* bits of the 0x49 status request */
+#define XDB4_STATUS_STABLE			0x01
+#define XDB4_STATUS_STREAMING		0x02
+#define XDB4_STATUS_CLOCK_LOCK		0x04
+#define XDB4_STATUS_LOCKED			(XDB4_STATUS_CLOCK_LOCK | XDB4_STATUS_STABLE)
 
 struct xonedb4_chip {
 	unsigned char firmwarever[15];
@@ -13,17 +20,22 @@ struct xonedb4_chip {
 	unsigned char status[1];
 	unsigned int devicerate;
 	unsigned int alsarate;
+	s64 init_us; /* duration of the last bring-up */
+	int regidx; /* slot in the driver's card table */
 	struct usb_device *dev;
 	struct snd_card *card;
 	struct pcm_runtime *pcm;
 	struct midi_runtime *midi;
+	struct xonedb4_recorder *recorder; /* debugfs flight recorder */
 };
 
 int xonedb4_get_firmware_ver(struct xonedb4_chip *chip);
-int xonedb4_reset(struct xonedb4_chip *chip);
 int xonedb4_set_samplerate(struct xonedb4_chip *chip);
 int xonedb4_send_allgood(struct xonedb4_chip *chip);
 int xonedb4_send_resets(struct xonedb4_chip *chip);
 int xonedb4_get_status(struct xonedb4_chip *chip);
 int xonedb4_get_samplerate(struct xonedb4_chip *chip);
+int xonedb4_wait_clock_lock(struct xonedb4_chip *chip);
+int xonedb4_switch_samplerate(struct xonedb4_chip *chip);
+int xonedb4_init_device(struct xonedb4_chip *chip);
 #endif /* XONEDB4_CHIP_H */
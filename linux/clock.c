@@ -0,0 +1,219 @@
+#include <linux/math64.h>
+#include <sound/control.h>
+#include <sound/info.h>
+
+#include "clock.h"
+#include "chip.h"
+
+/*
+ * Second order DLL as described by Fons Adriaensen ("Using a DLL to filter
+ * time"), fed with the completion time of every PCM OUT packet. The loop
+ * gains are powers of two so the filter runs on shifts only; b = sqrt(2) * w
+ * and c = w^2 are kept critically damped (c = b^2 / 2).
+ */
+#define CLOCK_SHIFT				16
+#define CLOCK_FAST_B_SHIFT		5	/* while settling, ~8 Hz bandwidth at 96 kHz */
+#define CLOCK_FAST_C_SHIFT		11
+#define CLOCK_B_SHIFT			8	/* once settled, ~1 Hz bandwidth at 96 kHz */
+#define CLOCK_C_SHIFT			17
+#define CLOCK_JITTER_SHIFT		6
+#define CLOCK_MAX_SLIP			4	/* phase error in updates before the loop restarts */
+
+#define CLOCK_RATIO_ONE			1000000000LL /* ratio is reported in parts per billion */
+#define CLOCK_MAX_JITTER_NS		10000000
+
+void xonedb4_clock_reset(struct xonedb4_clock *clk, unsigned int rate, unsigned int frames)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&clk->lock, flags);
+	clk->rate = rate;
+	clk->frames = frames;
+	clk->settle = rate / frames;
+	clk->updates = 0;
+	clk->nominal = div_u64((u64) frames * NSEC_PER_SEC << CLOCK_SHIFT, rate);
+	clk->period = clk->nominal;
+	clk->jitter = 0;
+	clk->t1 = 0;
+	clk->t1_frac = 0;
+	spin_unlock_irqrestore(&clk->lock, flags);
+}
+
+/* called from the URB completion handlers */
+void xonedb4_clock_update(struct xonedb4_clock *clk, ktime_t now)
+{
+	unsigned long flags;
+	unsigned int b_shift, c_shift;
+	s64 ns = ktime_to_ns(now);
+	s64 err, adv;
+
+	spin_lock_irqsave(&clk->lock, flags);
+	if (!clk->nominal) {
+		spin_unlock_irqrestore(&clk->lock, flags);
+		return;
+	}
+
+	err = ns - clk->t1;
+	if (!clk->updates || abs(err) > CLOCK_MAX_SLIP * (clk->nominal >> CLOCK_SHIFT)) {
+		/* first completion, or the stream stalled: restart the loop from here */
+		clk->t1 = ns;
+		clk->t1_frac = 0;
+		clk->period = clk->nominal;
+		clk->jitter = 0;
+		clk->updates = 0;
+		err = 0;
+	} else {
+		err = (err << CLOCK_SHIFT) - clk->t1_frac;
+	}
+
+	if (clk->updates < clk->settle) {
+		b_shift = CLOCK_FAST_B_SHIFT;
+		c_shift = CLOCK_FAST_C_SHIFT;
+	} else {
+		b_shift = CLOCK_B_SHIFT;
+		c_shift = CLOCK_C_SHIFT;
+	}
+
+	adv = clk->period + (err >> b_shift) + clk->t1_frac;
+	clk->period += err >> c_shift;
+	clk->period = clamp(clk->period, clk->nominal - (clk->nominal >> 4), clk->nominal + (clk->nominal >> 4));
+	clk->jitter += (abs(err) - clk->jitter) >> CLOCK_JITTER_SHIFT;
+
+	clk->t1 += adv >> CLOCK_SHIFT;
+	clk->t1_frac = adv & ((1 << CLOCK_SHIFT) - 1);
+	clk->updates++;
+	spin_unlock_irqrestore(&clk->lock, flags);
+}
+
+/* time the device takes for the given number of frames at its measured rate */
+u64 xonedb4_clock_frames_to_ns(struct xonedb4_clock *clk, unsigned int frames)
+{
+	unsigned long flags;
+	s64 period;
+	unsigned int per;
+
+	spin_lock_irqsave(&clk->lock, flags);
+	period = clk->period;
+	per = clk->frames;
+	spin_unlock_irqrestore(&clk->lock, flags);
+
+	if (!per)
+		return 0;
+
+	return div_u64((u64) frames * period, per) >> CLOCK_SHIFT;
+}
+
+/* device rate / nominal rate in parts per billion, jitter in ns */
+static bool xonedb4_clock_read(struct xonedb4_clock *clk, s64 *ratio, s64 *jitter)
+{
+	unsigned long flags;
+	bool settled;
+
+	spin_lock_irqsave(&clk->lock, flags);
+	settled = clk->nominal && clk->updates >= clk->settle;
+	if (settled) {
+		*ratio = CLOCK_RATIO_ONE + div64_s64((clk->nominal - clk->period) * CLOCK_RATIO_ONE, clk->period);
+		*jitter = clk->jitter >> CLOCK_SHIFT;
+	} else {
+		*ratio = CLOCK_RATIO_ONE;
+		*jitter = 0;
+	}
+	spin_unlock_irqrestore(&clk->lock, flags);
+
+	return settled;
+}
+
+static int xonedb4_clock_ratio_info(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = 2 * CLOCK_RATIO_ONE;
+	return 0;
+}
+
+static int xonedb4_clock_ratio_get(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+	struct xonedb4_clock *clk = snd_kcontrol_chip(kcontrol);
+	s64 ratio, jitter;
+
+	xonedb4_clock_read(clk, &ratio, &jitter);
+	ucontrol->value.integer.value[0] = clamp_t(s64, ratio, 0, 2 * CLOCK_RATIO_ONE);
+	return 0;
+}
+
+static int xonedb4_clock_jitter_info(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = CLOCK_MAX_JITTER_NS;
+	return 0;
+}
+
+static int xonedb4_clock_jitter_get(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+	struct xonedb4_clock *clk = snd_kcontrol_chip(kcontrol);
+	s64 ratio, jitter;
+
+	xonedb4_clock_read(clk, &ratio, &jitter);
+	ucontrol->value.integer.value[0] = min_t(s64, jitter, CLOCK_MAX_JITTER_NS);
+	return 0;
+}
+
+static const struct snd_kcontrol_new clock_controls[] = {
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+		.name = "Device Clock Ratio",
+		.access = SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+		.info = xonedb4_clock_ratio_info,
+		.get = xonedb4_clock_ratio_get
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+		.name = "Device Clock Jitter",
+		.access = SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+		.info = xonedb4_clock_jitter_info,
+		.get = xonedb4_clock_jitter_get
+	}
+};
+
+static void xonedb4_clock_proc_read(struct snd_info_entry *entry, struct snd_info_buffer *buffer)
+{
+	struct xonedb4_clock *clk = entry->private_data;
+	unsigned int rate = READ_ONCE(clk->rate);
+	unsigned long updates = READ_ONCE(clk->updates);
+	s64 ratio, jitter;
+	u64 hz, ratio_int;
+	u32 millihz, ratio_frac;
+	bool settled;
+
+	settled = xonedb4_clock_read(clk, &ratio, &jitter);
+	hz = div_u64_rem(div_u64((u64) rate * ratio, 1000000), 1000, &millihz);
+	ratio_int = div_u64_rem(ratio, CLOCK_RATIO_ONE, &ratio_frac);
+
+	snd_iprintf(buffer, "state: %s\n", !updates ? "idle" : settled ? "locked" : "settling");
+	snd_iprintf(buffer, "nominal rate: %u Hz\n", rate);
+	snd_iprintf(buffer, "measured rate: %llu.%03u Hz\n", hz, millihz);
+	snd_iprintf(buffer, "ratio: %llu.%09u\n", ratio_int, ratio_frac);
+	snd_iprintf(buffer, "jitter: %lld ns\n", jitter);
+	snd_iprintf(buffer, "updates: %lu\n", updates);
+}
+
+int xonedb4_clock_init(struct xonedb4_chip *chip, struct xonedb4_clock *clk)
+{
+	int i;
+	int ret;
+
+	spin_lock_init(&clk->lock);
+
+	for (i = 0; i < ARRAY_SIZE(clock_controls); i++) {
+		ret = snd_ctl_add(chip->card, snd_ctl_new1(&clock_controls[i], clk));
+		if (ret < 0) {
+			dev_err(&chip->dev->dev, "%s: Cannot add control!\n", __func__);
+			return ret;
+		}
+	}
+
+	return snd_card_ro_proc_new(chip->card, "xonedb4_clock", clk, xonedb4_clock_proc_read);
+}
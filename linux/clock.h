@@ -0,0 +1,30 @@
+#ifndef XONEDB4_CLOCK_H
+#define XONEDB4_CLOCK_H
+
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+
+struct xonedb4_chip;
+
+/* delay-locked loop tracking the device crystal against the host clock */
+struct xonedb4_clock {
+	spinlock_t lock;
+
+	unsigned int rate; /* nominal device samplerate */
+	unsigned int frames; /* frames transferred per update */
+	unsigned int settle; /* updates until the loop switches to its narrow bandwidth */
+	unsigned long updates; /* updates since the loop was (re)started */
+
+	/* all times in ns, fixed point with CLOCK_SHIFT fraction bits */
+	s64 nominal; /* nominal time between updates */
+	s64 period; /* filtered time between updates */
+	s64 jitter; /* filtered absolute phase error */
+	s64 t1; /* predicted time of the next update, integer ns */
+	s64 t1_frac; /* fractional part of t1 */
+};
+
+void xonedb4_clock_reset(struct xonedb4_clock *clk, unsigned int rate, unsigned int frames);
+void xonedb4_clock_update(struct xonedb4_clock *clk, ktime_t now);
+u64 xonedb4_clock_frames_to_ns(struct xonedb4_clock *clk, unsigned int frames);
+int xonedb4_clock_init(struct xonedb4_chip *chip, struct xonedb4_clock *clk);
+#endif /* XONEDB4_CLOCK_H */
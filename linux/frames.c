@@ -0,0 +1,162 @@
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <kunit/visibility.h>
+
+#include "frames.h"
+#include "../legacy/common/ploytec.h"
+
+/* runs of whole frames between the MIDI bytes of an OUT packet */
+struct out_run {
+	uint8_t first;
+	uint8_t frames;
+	uint16_t offset; /* in the packet */
+};
+
+static const struct out_run bulk_out_runs[] = {
+	{ 0, 10, 0 }, { 10, 10, 512 }, { 20, 10, 1024 }, { 30, 10, 1536 }
+};
+
+static const struct out_run int_out_runs[] = {
+	{ 0, 9, 0 }, { 9, 10, 434 }, { 19, 10, 916 }, { 29, 10, 1398 }, { 39, 1, 1880 }
+};
+
+static const struct out_run *xonedb4_frames_out_runs(bool bulk, unsigned int *n_runs)
+{
+	if (bulk) {
+		*n_runs = ARRAY_SIZE(bulk_out_runs);
+		return bulk_out_runs;
+	}
+
+	*n_runs = ARRAY_SIZE(int_out_runs);
+	return int_out_runs;
+}
+
+/* copies len bytes from off on in the ring buffer of a snapshot */
+static void xonedb4_frames_from_ring(const struct xonedb4_position *pos, unsigned int off, uint8_t *dest, unsigned int len)
+{
+	unsigned int first;
+
+	if (off >= pos->buffer_size)
+		off -= pos->buffer_size;
+	first = min(len, pos->buffer_size - off);
+	memcpy(dest, pos->dma_area + off, first);
+	memcpy(dest + first, pos->dma_area, len - first);
+}
+
+/* copies len bytes into the ring buffer of a snapshot, from its dma_off on */
+static void xonedb4_frames_to_ring(const struct xonedb4_position *pos, const uint8_t *src, unsigned int len)
+{
+	unsigned int first;
+
+	first = min_t(unsigned int, len, pos->buffer_size - pos->dma_off);
+	memcpy(pos->dma_area + pos->dma_off, src, first);
+	memcpy(pos->dma_area, src + first, len - first);
+}
+
+/* copies the substream's channels into the device channels routed from them */
+void xonedb4_frames_gather(const struct xonedb4_position *pos, uint8_t *frames, unsigned int n_frames, u64 route)
+{
+	unsigned int off = pos->dma_off;
+	unsigned int src;
+	unsigned int i;
+	unsigned int ch;
+
+	if (route == XDB4_ROUTE_IDENTITY && pos->frame_bytes == ALSA_BYTES_PER_FRAME) {
+		/* all channels, at most two copies around the end of the ring buffer */
+		xonedb4_frames_from_ring(pos, off, frames, n_frames * pos->frame_bytes);
+		return;
+	}
+
+	for (i = 0; i < n_frames; i++) {
+		if (route == XDB4_ROUTE_IDENTITY) {
+			memcpy(frames + (i * ALSA_BYTES_PER_FRAME) + (pos->first_channel * ALSA_BYTES_PER_SAMPLE), pos->dma_area + off, pos->frame_bytes);
+		} else {
+			for (ch = 0; ch < PCM_N_PLAYBACK_CHANNELS; ch++) {
+				src = xonedb4_frames_route_source(route, ch) - pos->first_channel;
+				if (src < pos->channels)
+					memcpy(frames + (i * ALSA_BYTES_PER_FRAME) + (ch * ALSA_BYTES_PER_SAMPLE), pos->dma_area + off + (src * ALSA_BYTES_PER_SAMPLE), ALSA_BYTES_PER_SAMPLE);
+			}
+		}
+		off += pos->frame_bytes;
+		if (off >= pos->buffer_size)
+			off = 0;
+	}
+}
+EXPORT_SYMBOL_IF_KUNIT(xonedb4_frames_gather);
+
+/* copies the device channels routed to the substream into it */
+void xonedb4_frames_scatter(const struct xonedb4_position *pos, const uint8_t *frames, unsigned int n_frames, u64 route)
+{
+	unsigned int off = pos->dma_off;
+	unsigned int src;
+	unsigned int i;
+	unsigned int ch;
+
+	if (route == XDB4_ROUTE_IDENTITY && pos->frame_bytes == ALSA_BYTES_PER_FRAME) {
+		xonedb4_frames_to_ring(pos, frames, n_frames * pos->frame_bytes);
+		return;
+	}
+
+	for (i = 0; i < n_frames; i++) {
+		if (route == XDB4_ROUTE_IDENTITY) {
+			memcpy(pos->dma_area + off, frames + (i * ALSA_BYTES_PER_FRAME) + (pos->first_channel * ALSA_BYTES_PER_SAMPLE), pos->frame_bytes);
+		} else {
+			for (ch = 0; ch < pos->channels; ch++) {
+				src = xonedb4_frames_route_source(route, pos->first_channel + ch);
+				memcpy(pos->dma_area + off + (ch * ALSA_BYTES_PER_SAMPLE), frames + (i * ALSA_BYTES_PER_FRAME) + (src * ALSA_BYTES_PER_SAMPLE), ALSA_BYTES_PER_SAMPLE);
+			}
+		}
+		off += pos->frame_bytes;
+		if (off >= pos->buffer_size)
+			off = 0;
+	}
+}
+EXPORT_SYMBOL_IF_KUNIT(xonedb4_frames_scatter);
+
+/* IN packet to S24_3LE frames of all channels */
+void xonedb4_frames_decode(uint8_t *frames, uint8_t *packet)
+{
+	unsigned int i;
+
+	for (i = 0; i < XDB4_PCM_IN_FRAMES_PER_PACKET; i++)
+		ploytec_convert_to_s24_3le(frames + (i * ALSA_BYTES_PER_FRAME), packet + (i * XDB4_PCM_IN_FRAME_SIZE));
+}
+EXPORT_SYMBOL_IF_KUNIT(xonedb4_frames_decode);
+
+/* S24_3LE frames of all channels to an OUT packet, leaves the MIDI bytes alone */
+void xonedb4_frames_encode(uint8_t *packet, uint8_t *frames, bool bulk)
+{
+	const struct out_run *runs;
+	unsigned int n_runs;
+	unsigned int i, j;
+	unsigned int frame;
+
+	runs = xonedb4_frames_out_runs(bulk, &n_runs);
+	for (i = 0; i < n_runs; i++) {
+		for (j = 0; j < runs[i].frames; j++) {
+			frame = runs[i].first + j;
+			ploytec_convert_from_s24_3le(packet + runs[i].offset + (j * XDB4_PCM_OUT_FRAME_SIZE), frames + (frame * ALSA_BYTES_PER_FRAME));
+		}
+	}
+}
+EXPORT_SYMBOL_IF_KUNIT(xonedb4_frames_encode);
+
+/* raw_pcm: the ALSA frames already are device frames */
+void xonedb4_frames_raw_out(const struct xonedb4_position *pos, uint8_t *packet, bool bulk)
+{
+	const struct out_run *runs;
+	unsigned int n_runs;
+	unsigned int i;
+
+	runs = xonedb4_frames_out_runs(bulk, &n_runs);
+	for (i = 0; i < n_runs; i++)
+		xonedb4_frames_from_ring(pos, pos->dma_off + runs[i].first * XDB4_PCM_OUT_FRAME_SIZE, packet + runs[i].offset, runs[i].frames * XDB4_PCM_OUT_FRAME_SIZE);
+}
+EXPORT_SYMBOL_IF_KUNIT(xonedb4_frames_raw_out);
+
+/* raw_pcm: IN packets are whole device frames */
+void xonedb4_frames_raw_in(const struct xonedb4_position *pos, const uint8_t *packet)
+{
+	xonedb4_frames_to_ring(pos, packet, XDB4_PCM_IN_PACKET_SIZE);
+}
+EXPORT_SYMBOL_IF_KUNIT(xonedb4_frames_raw_in);
@@ -0,0 +1,76 @@
+#ifndef XONEDB4_FRAMES_H
+#define XONEDB4_FRAMES_H
+
+#include <linux/types.h>
+#include <sound/pcm.h>
+
+#define PCM_N_PLAYBACK_CHANNELS			8
+#define PCM_N_CAPTURE_CHANNELS			8
+
+#define XDB4_PCM_OUT_FRAME_SIZE			48
+#define XDB4_PCM_IN_FRAME_SIZE			64
+#define XDB4_PCM_OUT_FRAMES_PER_PACKET	40
+#define XDB4_PCM_IN_FRAMES_PER_PACKET	32
+#define XDB4_UART_OUT_BYTES_PER_PACKET	8
+#define XDB4_PCM_BULK_OUT_PACKET_SIZE	((XDB4_PCM_OUT_FRAMES_PER_PACKET * XDB4_PCM_OUT_FRAME_SIZE) + XDB4_UART_OUT_BYTES_PER_PACKET + ((XDB4_PCM_OUT_FRAMES_PER_PACKET / 10) * 30)) // 40 frames
+#define XDB4_PCM_INT_OUT_PACKET_SIZE	((XDB4_PCM_OUT_FRAMES_PER_PACKET * XDB4_PCM_OUT_FRAME_SIZE) + XDB4_UART_OUT_BYTES_PER_PACKET) // 40 frames
+#define XDB4_PCM_IN_PACKET_SIZE			XDB4_PCM_IN_FRAMES_PER_PACKET * XDB4_PCM_IN_FRAME_SIZE // 32 frames
+
+#define XDB4_ROUTE_IDENTITY				0x0706050403020100ULL /* byte n holds the source of channel n */
+
+#define ALSA_BYTES_PER_SAMPLE			3 // S24_3LE
+#define ALSA_BYTES_PER_FRAME			PCM_N_PLAYBACK_CHANNELS * ALSA_BYTES_PER_SAMPLE
+#define ALSA_PCM_OUT_PACKET_SIZE		PCM_N_PLAYBACK_CHANNELS * ALSA_BYTES_PER_SAMPLE * XDB4_PCM_OUT_FRAMES_PER_PACKET
+#define ALSA_PCM_IN_PACKET_SIZE			PCM_N_CAPTURE_CHANNELS * ALSA_BYTES_PER_SAMPLE * XDB4_PCM_IN_FRAMES_PER_PACKET
+#define ALSA_MAX_BUFSIZE				2000 * ALSA_PCM_OUT_PACKET_SIZE
+#define ALSA_PERIODS_MIN				2
+#define ALSA_PERIODS_MAX				1024
+
+/*
+ * What a completion handler needs to convert one packet outside the lock.
+ * The helpers below only work on this and plain buffers, they touch no
+ * URB, substream or lock.
+ */
+struct xonedb4_position {
+	uint8_t *dma_area;
+	unsigned int buffer_size; /* in bytes */
+	snd_pcm_uframes_t dma_off; /* in bytes */
+	unsigned int gen;
+	unsigned int frame_bytes;
+	unsigned int first_channel;
+	unsigned int channels;
+};
+
+static inline unsigned int xonedb4_frames_route_source(u64 route, unsigned int channel)
+{
+	return (route >> (channel * 8)) & 0xff;
+}
+
+/* ring buffer offset after the given frames, the buffer holds at least one packet */
+static inline snd_pcm_uframes_t xonedb4_frames_next(const struct xonedb4_position *pos, unsigned int frames)
+{
+	snd_pcm_uframes_t off = pos->dma_off + frames * pos->frame_bytes;
+
+	if (off >= pos->buffer_size)
+		off -= pos->buffer_size;
+	return off;
+}
+
+/* moves the position in the period on, returns true if a period elapsed */
+static inline bool xonedb4_frames_period(snd_pcm_uframes_t *period_off, unsigned int frames, snd_pcm_uframes_t period_size)
+{
+	*period_off += frames;
+	if (*period_off >= period_size) {
+		*period_off %= period_size;
+		return true;
+	}
+	return false;
+}
+
+void xonedb4_frames_gather(const struct xonedb4_position *pos, uint8_t *frames, unsigned int n_frames, u64 route);
+void xonedb4_frames_scatter(const struct xonedb4_position *pos, const uint8_t *frames, unsigned int n_frames, u64 route);
+void xonedb4_frames_decode(uint8_t *frames, uint8_t *packet);
+void xonedb4_frames_encode(uint8_t *packet, uint8_t *frames, bool bulk);
+void xonedb4_frames_raw_out(const struct xonedb4_position *pos, uint8_t *packet, bool bulk);
+void xonedb4_frames_raw_in(const struct xonedb4_position *pos, const uint8_t *packet);
+#endif /* XONEDB4_FRAMES_H */
@@ -0,0 +1,538 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * KUnit tests for the position and packing helpers in frames.c, driven by
+ * synthetic packets. The device bit layout is rebuilt bit by bit here, so
+ * the tests don't just repeat what ploytec.c does.
+ */
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+
+#include "frames.h"
+
+static unsigned int bench_seconds = 1;
+module_param(bench_seconds, uint, 0644);
+MODULE_PARM_DESC(bench_seconds, "Seconds of 96 kHz audio the benchmark converts, 0 skips it");
+
+#define TEST_BUFFER_FRAMES			100 /* not a packet multiple */
+#define TEST_PAIR_FRAME_BYTES		(2 * ALSA_BYTES_PER_SAMPLE)
+#define TEST_STEPS					6 /* packets run from each start position */
+#define TEST_BENCH_RATE				96000
+#define TEST_BENCH_BUFFER_FRAMES	4800
+
+static const u16 int_midi[] = { 432, 914, 1396, 1878 }; /* two MIDI bytes each */
+
+static u32 test_seed;
+
+static void test_fill(uint8_t *buf, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		test_seed = test_seed * 1103515245 + 12345;
+		buf[i] = test_seed >> 16;
+	}
+}
+
+/* where frame i of an OUT packet starts */
+static unsigned int test_out_offset(unsigned int i, bool bulk)
+{
+	unsigned int off = 0;
+	unsigned int k = 0;
+	unsigned int n;
+
+	if (bulk)
+		return (i / 10) * 512 + (i % 10) * XDB4_PCM_OUT_FRAME_SIZE;
+
+	for (n = 0; n <= i; n++) {
+		if (k < ARRAY_SIZE(int_midi) && off == int_midi[k]) {
+			off += 2;
+			k++;
+		}
+		if (n < i)
+			off += XDB4_PCM_OUT_FRAME_SIZE;
+	}
+	return off;
+}
+
+/*
+ * Device frames hold the odd ALSA channels in the first half and the even
+ * ones in the second. Byte w of a half carries bit 7 - w % 8 of sample
+ * byte 2 - w / 8, its bit j belongs to channel 2 * j + half. OUT halves
+ * are 24 bytes apart, IN halves 32.
+ */
+static void test_ref_device_frame(uint8_t *dev, const uint8_t *alsa, unsigned int half_stride)
+{
+	unsigned int half, w, j;
+	unsigned int ch, byte, bit;
+
+	for (half = 0; half < 2; half++) {
+		for (w = 0; w < 24; w++) {
+			byte = 2 - w / 8;
+			bit = 7 - w % 8;
+			dev[half * half_stride + w] = 0;
+			for (j = 0; j < 4; j++) {
+				ch = 2 * j + half;
+				if (alsa[ch * ALSA_BYTES_PER_SAMPLE + byte] & BIT(bit))
+					dev[half * half_stride + w] |= BIT(j);
+			}
+		}
+	}
+}
+
+static void test_ref_alsa_frame(uint8_t *alsa, const uint8_t *dev, unsigned int half_stride)
+{
+	unsigned int half, w, j;
+	unsigned int ch, byte, bit;
+
+	memset(alsa, 0, ALSA_BYTES_PER_FRAME);
+	for (half = 0; half < 2; half++) {
+		for (w = 0; w < 24; w++) {
+			byte = 2 - w / 8;
+			bit = 7 - w % 8;
+			for (j = 0; j < 4; j++) {
+				ch = 2 * j + half;
+				if (dev[half * half_stride + w] & BIT(j))
+					alsa[ch * ALSA_BYTES_PER_SAMPLE + byte] |= BIT(bit);
+			}
+		}
+	}
+}
+
+static void frames_test_encode(struct kunit *test, bool bulk)
+{
+	unsigned int size = bulk ? XDB4_PCM_BULK_OUT_PACKET_SIZE : XDB4_PCM_INT_OUT_PACKET_SIZE;
+	uint8_t *frames, *packet, *expected;
+	unsigned int i;
+
+	frames = kunit_kmalloc(test, ALSA_PCM_OUT_PACKET_SIZE, GFP_KERNEL);
+	packet = kunit_kmalloc(test, size, GFP_KERNEL);
+	expected = kunit_kmalloc(test, size, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, frames);
+	KUNIT_ASSERT_NOT_NULL(test, packet);
+	KUNIT_ASSERT_NOT_NULL(test, expected);
+
+	test_fill(frames, ALSA_PCM_OUT_PACKET_SIZE);
+	/* stands in for the MIDI bytes and the padding, which must stay */
+	memset(packet, 0xa5, size);
+	memset(expected, 0xa5, size);
+
+	for (i = 0; i < XDB4_PCM_OUT_FRAMES_PER_PACKET; i++)
+		test_ref_device_frame(expected + test_out_offset(i, bulk), frames + i * ALSA_BYTES_PER_FRAME, 24);
+
+	xonedb4_frames_encode(packet, frames, bulk);
+	KUNIT_EXPECT_MEMEQ(test, packet, expected, size);
+}
+
+static void frames_test_encode_bulk(struct kunit *test)
+{
+	frames_test_encode(test, true);
+}
+
+static void frames_test_encode_int(struct kunit *test)
+{
+	frames_test_encode(test, false);
+}
+
+static void frames_test_decode(struct kunit *test)
+{
+	uint8_t *frames, *packet, *expected;
+	unsigned int i;
+
+	frames = kunit_kmalloc(test, ALSA_PCM_IN_PACKET_SIZE, GFP_KERNEL);
+	expected = kunit_kmalloc(test, ALSA_PCM_IN_PACKET_SIZE, GFP_KERNEL);
+	packet = kunit_kmalloc(test, XDB4_PCM_IN_PACKET_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, frames);
+	KUNIT_ASSERT_NOT_NULL(test, expected);
+	KUNIT_ASSERT_NOT_NULL(test, packet);
+
+	test_fill(packet, XDB4_PCM_IN_PACKET_SIZE);
+	for (i = 0; i < XDB4_PCM_IN_FRAMES_PER_PACKET; i++)
+		test_ref_alsa_frame(expected + i * ALSA_BYTES_PER_FRAME, packet + i * XDB4_PCM_IN_FRAME_SIZE, 32);
+
+	xonedb4_frames_decode(frames, packet);
+	KUNIT_EXPECT_MEMEQ(test, frames, expected, ALSA_PCM_IN_PACKET_SIZE);
+}
+
+struct frames_test_route {
+	const char *name;
+	unsigned int first_channel;
+	unsigned int channels;
+	u64 route;
+	unsigned int start_frame; /* in the ring buffer */
+};
+
+static const struct frames_test_route route_cases[] = {
+	{ "all channels", 0, 8, XDB4_ROUTE_IDENTITY, 0 },
+	{ "all channels, wrapping", 0, 8, XDB4_ROUTE_IDENTITY, TEST_BUFFER_FRAMES - 7 },
+	{ "pair 3-4, wrapping", 2, 2, XDB4_ROUTE_IDENTITY, TEST_BUFFER_FRAMES - 13 },
+	{ "pair 7-8", 6, 2, XDB4_ROUTE_IDENTITY, 3 },
+	{ "all channels, reversed", 0, 8, 0x0001020304050607ULL, TEST_BUFFER_FRAMES - 1 },
+	{ "pair 1-2, also swapped on 5-6", 0, 2, 0x0706000103020100ULL, TEST_BUFFER_FRAMES - 20 },
+};
+
+static void frames_test_route_desc(const struct frames_test_route *t, char *desc)
+{
+	strscpy(desc, t->name, KUNIT_PARAM_DESC_SIZE);
+}
+
+KUNIT_ARRAY_PARAM(frames_test_route, route_cases, frames_test_route_desc);
+
+static struct xonedb4_position frames_test_position(struct kunit *test, const struct frames_test_route *t)
+{
+	struct xonedb4_position pos = {
+		.frame_bytes = t->channels * ALSA_BYTES_PER_SAMPLE,
+		.first_channel = t->first_channel,
+		.channels = t->channels,
+	};
+
+	pos.buffer_size = TEST_BUFFER_FRAMES * pos.frame_bytes;
+	pos.dma_off = t->start_frame * pos.frame_bytes;
+	pos.dma_area = kunit_kmalloc(test, pos.buffer_size, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, pos.dma_area);
+	return pos;
+}
+
+/* ring byte of a substream channel in frame i of the packet */
+static unsigned int test_ring_offset(const struct xonedb4_position *pos, unsigned int i, unsigned int ch)
+{
+	return (pos->dma_off + i * pos->frame_bytes) % pos->buffer_size + ch * ALSA_BYTES_PER_SAMPLE;
+}
+
+static void frames_test_gather(struct kunit *test)
+{
+	const struct frames_test_route *t = test->param_value;
+	struct xonedb4_position pos = frames_test_position(test, t);
+	uint8_t *frames, *expected;
+	unsigned int i, ch, src;
+
+	frames = kunit_kmalloc(test, ALSA_PCM_OUT_PACKET_SIZE, GFP_KERNEL);
+	expected = kunit_kmalloc(test, ALSA_PCM_OUT_PACKET_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, frames);
+	KUNIT_ASSERT_NOT_NULL(test, expected);
+
+	test_fill(pos.dma_area, pos.buffer_size);
+	/* device channels nothing is routed to keep what other substreams put there */
+	memset(frames, 0x5a, ALSA_PCM_OUT_PACKET_SIZE);
+	memset(expected, 0x5a, ALSA_PCM_OUT_PACKET_SIZE);
+
+	for (i = 0; i < XDB4_PCM_OUT_FRAMES_PER_PACKET; i++) {
+		for (ch = 0; ch < PCM_N_PLAYBACK_CHANNELS; ch++) {
+			src = xonedb4_frames_route_source(t->route, ch) - t->first_channel;
+			if (src < t->channels)
+				memcpy(expected + i * ALSA_BYTES_PER_FRAME + ch * ALSA_BYTES_PER_SAMPLE, pos.dma_area + test_ring_offset(&pos, i, src), ALSA_BYTES_PER_SAMPLE);
+		}
+	}
+
+	xonedb4_frames_gather(&pos, frames, XDB4_PCM_OUT_FRAMES_PER_PACKET, t->route);
+	KUNIT_EXPECT_MEMEQ(test, frames, expected, ALSA_PCM_OUT_PACKET_SIZE);
+}
+
+static void frames_test_scatter(struct kunit *test)
+{
+	const struct frames_test_route *t = test->param_value;
+	struct xonedb4_position pos = frames_test_position(test, t);
+	uint8_t *frames, *expected;
+	unsigned int i, ch, src;
+
+	frames = kunit_kmalloc(test, ALSA_PCM_IN_PACKET_SIZE, GFP_KERNEL);
+	expected = kunit_kmalloc(test, pos.buffer_size, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, frames);
+	KUNIT_ASSERT_NOT_NULL(test, expected);
+
+	test_fill(frames, ALSA_PCM_IN_PACKET_SIZE);
+	/* the rest of the ring buffer stays as it is */
+	memset(pos.dma_area, 0x3c, pos.buffer_size);
+	memset(expected, 0x3c, pos.buffer_size);
+
+	for (i = 0; i < XDB4_PCM_IN_FRAMES_PER_PACKET; i++) {
+		for (ch = 0; ch < t->channels; ch++) {
+			src = xonedb4_frames_route_source(t->route, t->first_channel + ch);
+			memcpy(expected + test_ring_offset(&pos, i, ch), frames + i * ALSA_BYTES_PER_FRAME + src * ALSA_BYTES_PER_SAMPLE, ALSA_BYTES_PER_SAMPLE);
+		}
+	}
+
+	xonedb4_frames_scatter(&pos, frames, XDB4_PCM_IN_FRAMES_PER_PACKET, t->route);
+	KUNIT_EXPECT_MEMEQ(test, pos.dma_area, expected, pos.buffer_size);
+}
+
+static void frames_test_raw_out(struct kunit *test, bool bulk)
+{
+	unsigned int size = bulk ? XDB4_PCM_BULK_OUT_PACKET_SIZE : XDB4_PCM_INT_OUT_PACKET_SIZE;
+	struct xonedb4_position pos = {
+		.frame_bytes = XDB4_PCM_OUT_FRAME_SIZE,
+		.buffer_size = TEST_BUFFER_FRAMES * XDB4_PCM_OUT_FRAME_SIZE,
+		.dma_off = (TEST_BUFFER_FRAMES - 3) * XDB4_PCM_OUT_FRAME_SIZE,
+	};
+	uint8_t *packet, *expected;
+	unsigned int i;
+
+	pos.dma_area = kunit_kmalloc(test, pos.buffer_size, GFP_KERNEL);
+	packet = kunit_kmalloc(test, size, GFP_KERNEL);
+	expected = kunit_kmalloc(test, size, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, pos.dma_area);
+	KUNIT_ASSERT_NOT_NULL(test, packet);
+	KUNIT_ASSERT_NOT_NULL(test, expected);
+
+	test_fill(pos.dma_area, pos.buffer_size);
+	memset(packet, 0xa5, size);
+	memset(expected, 0xa5, size);
+
+	for (i = 0; i < XDB4_PCM_OUT_FRAMES_PER_PACKET; i++)
+		memcpy(expected + test_out_offset(i, bulk), pos.dma_area + (pos.dma_off + i * pos.frame_bytes) % pos.buffer_size, XDB4_PCM_OUT_FRAME_SIZE);
+
+	xonedb4_frames_raw_out(&pos, packet, bulk);
+	KUNIT_EXPECT_MEMEQ(test, packet, expected, size);
+}
+
+static void frames_test_raw_out_bulk(struct kunit *test)
+{
+	frames_test_raw_out(test, true);
+}
+
+static void frames_test_raw_out_int(struct kunit *test)
+{
+	frames_test_raw_out(test, false);
+}
+
+static void frames_test_raw_in(struct kunit *test)
+{
+	struct xonedb4_position pos = {
+		.frame_bytes = XDB4_PCM_IN_FRAME_SIZE,
+		.buffer_size = TEST_BUFFER_FRAMES * XDB4_PCM_IN_FRAME_SIZE,
+		.dma_off = (TEST_BUFFER_FRAMES - 5) * XDB4_PCM_IN_FRAME_SIZE,
+	};
+	uint8_t *packet, *expected;
+	unsigned int i;
+
+	pos.dma_area = kunit_kmalloc(test, pos.buffer_size, GFP_KERNEL);
+	packet = kunit_kmalloc(test, XDB4_PCM_IN_PACKET_SIZE, GFP_KERNEL);
+	expected = kunit_kmalloc(test, pos.buffer_size, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, pos.dma_area);
+	KUNIT_ASSERT_NOT_NULL(test, packet);
+	KUNIT_ASSERT_NOT_NULL(test, expected);
+
+	test_fill(packet, XDB4_PCM_IN_PACKET_SIZE);
+	memset(pos.dma_area, 0x3c, pos.buffer_size);
+	memset(expected, 0x3c, pos.buffer_size);
+
+	for (i = 0; i < XDB4_PCM_IN_FRAMES_PER_PACKET; i++)
+		memcpy(expected + (pos.dma_off + i * pos.frame_bytes) % pos.buffer_size, packet + i * XDB4_PCM_IN_FRAME_SIZE, XDB4_PCM_IN_FRAME_SIZE);
+
+	xonedb4_frames_raw_in(&pos, packet);
+	KUNIT_EXPECT_MEMEQ(test, pos.dma_area, expected, pos.buffer_size);
+}
+
+struct frames_test_geometry {
+	const char *name;
+	unsigned int frame_bytes;
+	unsigned int packet_frames; /* also the shortest period */
+};
+
+/* every substream kind: 8 channels, stereo pairs, loopback and raw_pcm */
+static const struct frames_test_geometry geometries[] = {
+	{ "playback", ALSA_BYTES_PER_FRAME, XDB4_PCM_OUT_FRAMES_PER_PACKET },
+	{ "capture", ALSA_BYTES_PER_FRAME, XDB4_PCM_IN_FRAMES_PER_PACKET },
+	{ "pair playback", TEST_PAIR_FRAME_BYTES, XDB4_PCM_OUT_FRAMES_PER_PACKET },
+	{ "pair capture", TEST_PAIR_FRAME_BYTES, XDB4_PCM_IN_FRAMES_PER_PACKET },
+	{ "raw playback", XDB4_PCM_OUT_FRAME_SIZE, XDB4_PCM_OUT_FRAMES_PER_PACKET },
+	{ "raw capture", XDB4_PCM_IN_FRAME_SIZE, XDB4_PCM_IN_FRAMES_PER_PACKET },
+};
+
+static void frames_test_geometry_desc(const struct frames_test_geometry *g, char *desc)
+{
+	strscpy(desc, g->name, KUNIT_PARAM_DESC_SIZE);
+}
+
+KUNIT_ARRAY_PARAM(frames_test_geometry, geometries, frames_test_geometry_desc);
+
+/*
+ * Runs a few packets from frame f on and checks dma_off and period_off
+ * against plain modulo arithmetic, and that a period elapses exactly on
+ * the packet that crosses a period boundary.
+ */
+static bool frames_test_run(struct kunit *test, const struct frames_test_geometry *g, unsigned int period, unsigned int periods, u64 f)
+{
+	u64 buffer = (u64)period * periods;
+	struct xonedb4_position pos = {
+		.frame_bytes = g->frame_bytes,
+		.buffer_size = buffer * g->frame_bytes,
+		.dma_off = (f % buffer) * g->frame_bytes,
+	};
+	snd_pcm_uframes_t period_off = f % period;
+	bool elapsed, crossed;
+	unsigned int n;
+
+	for (n = 0; n < TEST_STEPS; n++) {
+		pos.dma_off = xonedb4_frames_next(&pos, g->packet_frames);
+		elapsed = xonedb4_frames_period(&period_off, g->packet_frames, period);
+		crossed = div_u64(f + g->packet_frames, period) != div_u64(f, period);
+		f += g->packet_frames;
+
+		if (pos.dma_off != (f % buffer) * g->frame_bytes || period_off != f % period || elapsed != crossed) {
+			KUNIT_FAIL(test, "period %u x %u, frame %llu: dma_off %lu (expected %llu), period_off %lu (expected %llu), elapsed %d",
+				   period, periods, f, pos.dma_off, (f % buffer) * g->frame_bytes, period_off, f % period, elapsed);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* every period size and count pcm_hw and the open constraints allow */
+static void frames_test_positions(struct kunit *test)
+{
+	const struct frames_test_geometry *g = test->param_value;
+	unsigned int max_frames = ALSA_MAX_BUFSIZE / g->frame_bytes;
+	unsigned int period, periods;
+	unsigned long combinations = 0;
+	u64 buffer;
+
+	for (period = g->packet_frames; period <= max_frames / ALSA_PERIODS_MIN; period++) {
+		for (periods = ALSA_PERIODS_MIN; periods <= ALSA_PERIODS_MAX && period * periods <= max_frames; periods++) {
+			buffer = (u64)period * periods;
+			/* the start of the buffer, the first period boundary and the second wrap */
+			if (!frames_test_run(test, g, period, periods, 0) ||
+			    !frames_test_run(test, g, period, periods, period - g->packet_frames) ||
+			    !frames_test_run(test, g, period, periods, 2 * buffer - 3 * g->packet_frames))
+				return;
+			combinations++;
+		}
+		cond_resched();
+	}
+
+	kunit_info(test, "%lu buffer/period combinations\n", combinations);
+}
+
+struct frames_test_bench {
+	struct xonedb4_position pos[1 + 4]; /* 8 channels, then the pairs */
+	uint8_t *frames;
+	uint8_t *packet;
+};
+
+static void frames_test_bench_init(struct kunit *test, struct frames_test_bench *b)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(b->pos); i++) {
+		b->pos[i].channels = i ? 2 : PCM_N_PLAYBACK_CHANNELS;
+		b->pos[i].first_channel = i ? (i - 1) * 2 : 0;
+		b->pos[i].frame_bytes = b->pos[i].channels * ALSA_BYTES_PER_SAMPLE;
+		b->pos[i].buffer_size = TEST_BENCH_BUFFER_FRAMES * b->pos[i].frame_bytes;
+		b->pos[i].dma_area = kunit_kzalloc(test, b->pos[i].buffer_size, GFP_KERNEL);
+		KUNIT_ASSERT_NOT_NULL(test, b->pos[i].dma_area);
+		test_fill(b->pos[i].dma_area, b->pos[i].buffer_size);
+	}
+	b->frames = kunit_kzalloc(test, ALSA_PCM_OUT_PACKET_SIZE, GFP_KERNEL);
+	b->packet = kunit_kzalloc(test, XDB4_PCM_BULK_OUT_PACKET_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, b->frames);
+	KUNIT_ASSERT_NOT_NULL(test, b->packet);
+	test_fill(b->packet, XDB4_PCM_IN_PACKET_SIZE);
+}
+
+enum {
+	BENCH_PLAYBACK,
+	BENCH_PLAYBACK_PAIRS,
+	BENCH_PLAYBACK_ROUTED,
+	BENCH_CAPTURE,
+	BENCH_N_KINDS
+};
+
+static const char * const bench_names[BENCH_N_KINDS] = {
+	"playback, 8 channels", "playback, 4 pairs", "playback, routed", "capture, 8 channels"
+};
+
+/* one packet the way the completion handlers convert it */
+static void frames_test_bench_packet(struct frames_test_bench *b, int kind)
+{
+	unsigned int i;
+
+	switch (kind) {
+	case BENCH_PLAYBACK:
+		xonedb4_frames_gather(&b->pos[0], b->frames, XDB4_PCM_OUT_FRAMES_PER_PACKET, XDB4_ROUTE_IDENTITY);
+		xonedb4_frames_encode(b->packet, b->frames, true);
+		b->pos[0].dma_off = xonedb4_frames_next(&b->pos[0], XDB4_PCM_OUT_FRAMES_PER_PACKET);
+		break;
+	case BENCH_PLAYBACK_PAIRS:
+		for (i = 1; i < ARRAY_SIZE(b->pos); i++) {
+			xonedb4_frames_gather(&b->pos[i], b->frames, XDB4_PCM_OUT_FRAMES_PER_PACKET, XDB4_ROUTE_IDENTITY);
+			b->pos[i].dma_off = xonedb4_frames_next(&b->pos[i], XDB4_PCM_OUT_FRAMES_PER_PACKET);
+		}
+		xonedb4_frames_encode(b->packet, b->frames, true);
+		break;
+	case BENCH_PLAYBACK_ROUTED:
+		xonedb4_frames_gather(&b->pos[0], b->frames, XDB4_PCM_OUT_FRAMES_PER_PACKET, 0x0001020304050607ULL);
+		xonedb4_frames_encode(b->packet, b->frames, true);
+		b->pos[0].dma_off = xonedb4_frames_next(&b->pos[0], XDB4_PCM_OUT_FRAMES_PER_PACKET);
+		break;
+	case BENCH_CAPTURE:
+		xonedb4_frames_decode(b->frames, b->packet);
+		xonedb4_frames_scatter(&b->pos[0], b->frames, XDB4_PCM_IN_FRAMES_PER_PACKET, XDB4_ROUTE_IDENTITY);
+		b->pos[0].dma_off = xonedb4_frames_next(&b->pos[0], XDB4_PCM_IN_FRAMES_PER_PACKET);
+		break;
+	}
+}
+
+/* time the conversions take per second of 96 kHz audio, run on an idle CPU */
+static void frames_test_benchmark(struct kunit *test)
+{
+	struct frames_test_bench b = {};
+	unsigned int packet_frames;
+	unsigned int n, packets;
+	u64 start, ns;
+	int kind;
+
+	if (!bench_seconds)
+		kunit_skip(test, "bench_seconds=0");
+
+	frames_test_bench_init(test, &b);
+
+	for (kind = 0; kind < BENCH_N_KINDS; kind++) {
+		packet_frames = kind == BENCH_CAPTURE ? XDB4_PCM_IN_FRAMES_PER_PACKET : XDB4_PCM_OUT_FRAMES_PER_PACKET;
+		packets = bench_seconds * (TEST_BENCH_RATE / packet_frames);
+
+		start = ktime_get_ns();
+		for (n = 0; n < packets; n++) {
+			frames_test_bench_packet(&b, kind);
+			if (!(n % 1000))
+				cond_resched();
+		}
+		ns = div_u64(ktime_get_ns() - start, bench_seconds);
+
+		kunit_info(test, "%s: %llu ns per second of audio\n", bench_names[kind], ns);
+	}
+}
+
+static struct kunit_case frames_test_cases[] = {
+	KUNIT_CASE(frames_test_encode_bulk),
+	KUNIT_CASE(frames_test_encode_int),
+	KUNIT_CASE(frames_test_decode),
+	KUNIT_CASE_PARAM(frames_test_gather, frames_test_route_gen_params),
+	KUNIT_CASE_PARAM(frames_test_scatter, frames_test_route_gen_params),
+	KUNIT_CASE(frames_test_raw_out_bulk),
+	KUNIT_CASE(frames_test_raw_out_int),
+	KUNIT_CASE(frames_test_raw_in),
+	KUNIT_CASE_PARAM_ATTR(frames_test_positions, frames_test_geometry_gen_params, { .speed = KUNIT_SPEED_SLOW }),
+	KUNIT_CASE_SLOW(frames_test_benchmark),
+	{}
+};
+
+static int frames_test_init(struct kunit *test)
+{
+	test_seed = 0x5eed;
+	return 0;
+}
+
+static struct kunit_suite frames_test_suite = {
+	.name = "snd-usb-xonedb4-frames",
+	.init = frames_test_init,
+	.test_cases = frames_test_cases,
+};
+
+kunit_test_suite(frames_test_suite);
+
+MODULE_DESCRIPTION("KUnit tests for the Xone:DB4 position and packing helpers");
+MODULE_LICENSE("GPL");
+MODULE_IMPORT_NS("EXPORTED_FOR_KUNIT_TESTING");
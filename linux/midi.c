@@ -2,21 +2,20 @@
 
 #include "midi.h"
 #include "chip.h"
+#include "pcm.h"
+#include "trace.h"
+#include "recorder.h"
 
 #define MIDI_IN_EP		3
 #define MIDI_N_URBS		4
+#define MIDI_KILL_TIMEOUT_MS	20
 
 #define XDB4_MIDI_PACKET_SIZE		512
-#define XDB4_MIDI_SEND_BUFFER_SIZE	512
-
-uint8_t uart_send_count = 0;
-uint8_t uart_to_sent = 0;
-u8 *uart_send_buffer;
+#define XDB4_MIDI_SEND_BUFFER_SIZE	512 /* power of two */
 
 struct midi_urb {
 	struct xonedb4_chip *chip;
 	struct urb instance;
-	struct usb_anchor submitted;
 	u8 *buffer;
 };
 
@@ -33,9 +32,32 @@ struct midi_runtime {
 	spinlock_t out_lock;
 
 	struct midi_urb midi_in_urbs[MIDI_N_URBS];
+	struct usb_anchor anchor; /* every MIDI IN URB in flight */
 	u8 *out_buffer;
+
+	/* ring of bytes waiting to ride along in the PCM OUT packets, under out_lock */
+	u8 *uart_send_buffer;
+	unsigned int uart_head; /* next byte to queue, free running */
+	unsigned int uart_tail; /* next byte to send, free running */
 };
 
+/* MIDI IN completion into the flight recorder, the bytes as received */
+static void xonedb4_midi_record(struct midi_urb *in_urb, int status)
+{
+	struct midi_runtime *rt = in_urb->chip->midi;
+	struct xonedb4_record r = {
+		.kind = XDB4_REC_MIDI_IN,
+		.index = in_urb - rt->midi_in_urbs,
+		.status = status,
+		.length = in_urb->instance.actual_length,
+		.time = ktime_get_ns()
+	};
+
+	r.n_midi = min_t(u32, r.length, XDB4_REC_MIDI_BYTES);
+	memcpy(r.midi, in_urb->buffer, r.n_midi);
+	xonedb4_recorder_add(in_urb->chip->recorder, &r);
+}
+
 static void xonedb4_midi_in_urb_handler(struct urb *usb_urb)
 {
 	struct midi_urb *in_urb = usb_urb->context;
@@ -44,7 +66,15 @@ static void xonedb4_midi_in_urb_handler(struct urb *usb_urb)
 	unsigned long flags;
 	int ret;
 
-	if (unlikely(usb_urb->status == -ENOENT || usb_urb->status == -ENODEV || usb_urb->status == -ECONNRESET || usb_urb->status == -ESHUTDOWN)) {
+	trace_xonedb4_midi_in_urb(in_urb->chip->card->number, in_urb - rt->midi_in_urbs, usb_urb->status, usb_urb->actual_length);
+	xonedb4_midi_record(in_urb, usb_urb->status);
+
+	if (unlikely(usb_urb->status == -ENOENT || usb_urb->status == -ECONNRESET)) {
+		/* killed for suspend, reset or teardown */
+		return;
+	}
+
+	if (unlikely(usb_urb->status == -ENODEV || usb_urb->status == -ESHUTDOWN)) {
 		goto in_fail;
 	}
 
@@ -54,7 +84,11 @@ static void xonedb4_midi_in_urb_handler(struct urb *usb_urb)
     }
 	spin_unlock_irqrestore(&rt->in_lock, flags);
 
+	usb_anchor_urb(&in_urb->instance, &rt->anchor);
 	ret = usb_submit_urb(&in_urb->instance, GFP_ATOMIC);
+	if (ret < 0) {
+		usb_unanchor_urb(&in_urb->instance);
+	}
 	
 	if (ret < 0)
 		goto in_fail;
@@ -85,25 +119,52 @@ static int xonedb4_midi_out_close(struct snd_rawmidi_substream *alsa_sub)
 	return 0;
 }
 
-void xonedb4_get_midi_output(u8 *buffer, int count)
+void xonedb4_get_midi_output(struct xonedb4_chip *chip, u8 *buffer, int count)
 {
-	uint8_t i;
+	struct midi_runtime *rt = chip->midi;
+	unsigned long flags;
+	int i;
+
+	if (!rt) {
+		/* PCM OUT starts before the MIDI device exists */
+		memset(buffer, 0xFD, count);
+		return;
+	}
 
+	spin_lock_irqsave(&rt->out_lock, flags);
 	for (i = 0; i < count; i++) {
-		if (uart_to_sent > 0) {
-			buffer[i] = uart_send_buffer[uart_send_count];
-			uart_send_count++;
-			uart_to_sent--;
+		if (rt->uart_tail != rt->uart_head) {
+			buffer[i] = rt->uart_send_buffer[rt->uart_tail & (XDB4_MIDI_SEND_BUFFER_SIZE - 1)];
+			rt->uart_tail++;
 		} else {
-			uart_send_count = 0;
 			buffer[i] = 0xFD;
 		}
 	}
+	spin_unlock_irqrestore(&rt->out_lock, flags);
+}
+
+bool xonedb4_midi_pending(struct xonedb4_chip *chip)
+{
+	struct midi_runtime *rt = chip->midi;
+	unsigned long flags;
+	bool pending;
+
+	if (!rt)
+		return false;
+
+	spin_lock_irqsave(&rt->out_lock, flags);
+	pending = rt->uart_tail != rt->uart_head;
+	spin_unlock_irqrestore(&rt->out_lock, flags);
+
+	return pending;
 }
 
 static void xonedb4_midi_out_trigger(struct snd_rawmidi_substream *alsa_sub, int up)
 {
 	struct midi_runtime *rt = alsa_sub->rmidi->private_data;
+	unsigned int space;
+	unsigned int pos;
+	unsigned int n;
 	int ret;
 	unsigned long flags;
 
@@ -115,17 +176,28 @@ static void xonedb4_midi_out_trigger(struct snd_rawmidi_substream *alsa_sub, int
 		}
 
 		ret = snd_rawmidi_transmit(alsa_sub, rt->out_buffer, 64);
+		space = XDB4_MIDI_SEND_BUFFER_SIZE - (rt->uart_head - rt->uart_tail);
 		if (ret > 0) {
-			if (uart_to_sent > (XDB4_MIDI_SEND_BUFFER_SIZE - ret)) {
+			if ((unsigned int)ret > space) {
 				dev_notice(&rt->chip->dev->dev, "%s: MIDI SEND BUFFER OVERFLOW\n", __func__);
 			} else {
-				memcpy(uart_send_buffer + uart_to_sent, rt->out_buffer, ret);
-				uart_to_sent += ret;
+				/* may wrap around the end of the ring */
+				pos = rt->uart_head & (XDB4_MIDI_SEND_BUFFER_SIZE - 1);
+				n = min_t(unsigned int, ret, XDB4_MIDI_SEND_BUFFER_SIZE - pos);
+				memcpy(rt->uart_send_buffer + pos, rt->out_buffer, n);
+				memcpy(rt->uart_send_buffer, rt->out_buffer + n, ret - n);
+				rt->uart_head += ret;
 			}
 		}
 	} else if (rt->out == alsa_sub)
 		rt->out = NULL;
+	trace_xonedb4_midi_out_trigger(rt->chip->card->number, up, rt->uart_head - rt->uart_tail);
 	spin_unlock_irqrestore(&rt->out_lock, flags);
+
+	if (up) {
+		/* PCM may be idle, get the bytes out now */
+		xonedb4_pcm_kick_midi(rt->chip);
+	}
 }
 
 static void xonedb4_midi_in_trigger(struct snd_rawmidi_substream *alsa_sub, int up)
@@ -143,15 +215,28 @@ static void xonedb4_midi_in_trigger(struct snd_rawmidi_substream *alsa_sub, int
 
 static void xonedb4_midi_kill_urbs(struct midi_runtime *rt)
 {
-	int i, time;
+	usb_unlink_anchored_urbs(&rt->anchor);
+	if (!usb_wait_anchor_empty_timeout(&rt->anchor, MIDI_KILL_TIMEOUT_MS)) {
+		usb_kill_anchored_urbs(&rt->anchor);
+	}
+}
+
+static int xonedb4_midi_submit_urbs(struct midi_runtime *rt)
+{
+	uint8_t i;
+	int ret;
 
 	for (i = 0; i < MIDI_N_URBS; i++) {
-		time = usb_wait_anchor_empty_timeout(&rt->midi_in_urbs[i].submitted, 100);
-		if (!time) {
-			usb_kill_anchored_urbs(&rt->midi_in_urbs[i].submitted);
+		usb_anchor_urb(&rt->midi_in_urbs[i].instance, &rt->anchor);
+		ret = usb_submit_urb(&rt->midi_in_urbs[i].instance, GFP_ATOMIC);
+		if (ret < 0) {
+			usb_unanchor_urb(&rt->midi_in_urbs[i].instance);
+			xonedb4_midi_kill_urbs(rt);
+			return ret;
 		}
-		usb_kill_urb(&rt->midi_in_urbs[i].instance);
 	}
+
+	return 0;
 }
 
 void xonedb4_midi_abort(struct xonedb4_chip *chip)
@@ -163,6 +248,27 @@ void xonedb4_midi_abort(struct xonedb4_chip *chip)
 	}
 }
 
+/* MIDI IN URBs are stopped around suspend and reset, queued MIDI OUT bytes stay */
+void xonedb4_midi_stop_urbs(struct xonedb4_chip *chip)
+{
+	struct midi_runtime *rt = chip->midi;
+
+	if (rt && rt->active) {
+		xonedb4_midi_kill_urbs(rt);
+	}
+}
+
+int xonedb4_midi_start_urbs(struct xonedb4_chip *chip)
+{
+	struct midi_runtime *rt = chip->midi;
+
+	if (!rt || !rt->active) {
+		return 0;
+	}
+
+	return xonedb4_midi_submit_urbs(rt);
+}
+
 static int xonedb4_midi_init_bulk_in_urb(struct midi_urb *urb, struct xonedb4_chip *chip, unsigned int ep, void (*handler)(struct urb *))
 {
 	urb->chip = chip;
@@ -178,7 +284,6 @@ static int xonedb4_midi_init_bulk_in_urb(struct midi_urb *urb, struct xonedb4_ch
 		dev_err(&chip->dev->dev, "%s: Sanity check failed!\n", __func__);
 		return -EINVAL;
 	}
-	init_usb_anchor(&urb->submitted);
 
 	return 0;
 }
@@ -191,6 +296,8 @@ int xonedb4_midi_init_bulk_urbs(struct xonedb4_chip *chip)
 	struct midi_runtime *rt = chip->midi;
 	rt->chip = chip;
 
+	init_usb_anchor(&rt->anchor);
+
 	for (i = 0; i < MIDI_N_URBS; i++) {
 		ret = xonedb4_midi_init_bulk_in_urb(&rt->midi_in_urbs[i], chip, MIDI_IN_EP, xonedb4_midi_in_urb_handler);
 		if (ret < 0) {
@@ -198,13 +305,9 @@ int xonedb4_midi_init_bulk_urbs(struct xonedb4_chip *chip)
 		}
 	}
 
-	for (i = 0; i < MIDI_N_URBS; i++) {
-		usb_anchor_urb(&rt->midi_in_urbs[i].instance, &rt->midi_in_urbs[i].submitted);
-		ret = usb_submit_urb(&rt->midi_in_urbs[i].instance, GFP_ATOMIC);
-		if (ret < 0) {
-			xonedb4_midi_kill_urbs(rt);
-			goto error;
-		}
+	ret = xonedb4_midi_submit_urbs(rt);
+	if (ret < 0) {
+		goto error;
 	}
 
 	return 0;
@@ -212,7 +315,6 @@ int xonedb4_midi_init_bulk_urbs(struct xonedb4_chip *chip)
 	error:
 	for (i = 0; i < MIDI_N_URBS; i++)
 		kfree(rt->midi_in_urbs[i].buffer);
-	kfree(rt);
 	return ret;
 }
 
@@ -245,8 +347,9 @@ int xonedb4_midi_init(struct xonedb4_chip *chip)
 		return -ENOMEM;
 	}
 
-	uart_send_buffer = kzalloc(XDB4_MIDI_SEND_BUFFER_SIZE, GFP_KERNEL);
-	if (!uart_send_buffer) {
+	rt->uart_send_buffer = kzalloc(XDB4_MIDI_SEND_BUFFER_SIZE, GFP_KERNEL);
+	if (!rt->uart_send_buffer) {
+		kfree(rt->out_buffer);
 		kfree(rt);
 		return -ENOMEM;
 	}
@@ -258,9 +361,8 @@ int xonedb4_midi_init(struct xonedb4_chip *chip)
 
 	ret = snd_rawmidi_new(chip->card, chip->dev->product, 0, 1, 1, &midi);
 	if (ret < 0) {
-		kfree(rt);
 		dev_err(&chip->dev->dev, "%s: Cannot create MIDI instance!\n", __func__);
-		return ret;
+		goto error;
 	}
 
 	midi->private_data = rt;
@@ -283,6 +385,9 @@ int xonedb4_midi_init(struct xonedb4_chip *chip)
 
 	error:
 	dev_err(&chip->dev->dev, "%s: ERROR\n", __func__);
+	chip->midi = NULL;
+	kfree(rt->uart_send_buffer);
+	kfree(rt->out_buffer);
 	kfree(rt);
 	return ret;
 }
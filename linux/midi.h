@@ -5,6 +5,9 @@ struct xonedb4_chip;
 
 int xonedb4_midi_init(struct xonedb4_chip *chip);
 int xonedb4_midi_init_bulk_urbs(struct xonedb4_chip *chip);
-void xonedb4_get_midi_output(u8 *buffer, int count);
+void xonedb4_get_midi_output(struct xonedb4_chip *chip, u8 *buffer, int count);
+bool xonedb4_midi_pending(struct xonedb4_chip *chip);
 void xonedb4_midi_abort(struct xonedb4_chip *chip);
+void xonedb4_midi_stop_urbs(struct xonedb4_chip *chip);
+int xonedb4_midi_start_urbs(struct xonedb4_chip *chip);
 #endif /* XONEDB4_MIDI_H */
@@ -1,49 +1,92 @@
 #include <linux/slab.h>
+#include <linux/moduleparam.h>
+#include <linux/hrtimer.h>
+#include <linux/delay.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
 #include <sound/pcm.h>
+#include <sound/timer.h>
+#include <sound/control.h>
 
 #include "pcm.h"
 #include "chip.h"
 #include "midi.h"
-#include "../legacy/common/ploytec.h"
+#include "clock.h"
+#include "stats.h"
+#include "trace.h"
+#include "frames.h"
+#include "recorder.h"
 
 #define PCM_OUT_EP						5
 #define PCM_IN_EP						6
 
 #define PCM_N_URBS						4
-#define PCM_N_PLAYBACK_CHANNELS			8
-#define PCM_N_CAPTURE_CHANNELS			8
-
-#define XDB4_PCM_OUT_FRAME_SIZE			48
-#define XDB4_PCM_IN_FRAME_SIZE			64
-#define XDB4_PCM_OUT_FRAMES_PER_PACKET	40
-#define XDB4_PCM_IN_FRAMES_PER_PACKET	32
-#define XDB4_UART_OUT_BYTES_PER_PACKET	8
-#define XDB4_PCM_BULK_OUT_PACKET_SIZE	((XDB4_PCM_OUT_FRAMES_PER_PACKET * XDB4_PCM_OUT_FRAME_SIZE) + XDB4_UART_OUT_BYTES_PER_PACKET + ((XDB4_PCM_OUT_FRAMES_PER_PACKET / 10) * 30)) // 40 frames
-#define XDB4_PCM_INT_OUT_PACKET_SIZE	((XDB4_PCM_OUT_FRAMES_PER_PACKET * XDB4_PCM_OUT_FRAME_SIZE) + XDB4_UART_OUT_BYTES_PER_PACKET) // 40 frames
-#define XDB4_PCM_IN_PACKET_SIZE			XDB4_PCM_IN_FRAMES_PER_PACKET * XDB4_PCM_IN_FRAME_SIZE // 32 frames
-
-#define ALSA_BYTES_PER_SAMPLE			3 // S24_3LE
-#define ALSA_BYTES_PER_FRAME			PCM_N_PLAYBACK_CHANNELS * ALSA_BYTES_PER_SAMPLE
-#define ALSA_PCM_OUT_PACKET_SIZE		PCM_N_PLAYBACK_CHANNELS * ALSA_BYTES_PER_SAMPLE * XDB4_PCM_OUT_FRAMES_PER_PACKET
-#define ALSA_PCM_IN_PACKET_SIZE			PCM_N_CAPTURE_CHANNELS * ALSA_BYTES_PER_SAMPLE * XDB4_PCM_IN_FRAMES_PER_PACKET
-#define ALSA_MIN_BUFSIZE				2 * ALSA_PCM_OUT_PACKET_SIZE
-#define ALSA_MAX_BUFSIZE				2000 * ALSA_PCM_OUT_PACKET_SIZE
+#define PCM_N_PAIRS						4 /* stereo devices sharing the URBs with the 8 channel one */
+#define PCM_N_DEVICES					(1 + PCM_N_PAIRS)
+#define PCM_LOOPBACK_DEVICE				PCM_N_DEVICES /* capture only, records the OUT URBs */
+#define PCM_RAW_DEVICE					(PCM_LOOPBACK_DEVICE + 1) /* raw_pcm, device format frames */
+#define PCM_N_INSTANCES					(PCM_RAW_DEVICE + 1)
+
+#define XDB4_IDLE_KEEPALIVE_MS			50 /* default, not measured against how long the device tolerates a gap */
+#define XDB4_IDLE_KEEPALIVE_MAX_MS		1000
+#define XDB4_KILL_TIMEOUT_MS			20 /* for all URBs of both streams together */
+#define XDB4_RECOVERY_BURST				5 /* restarts allowed per window before giving up */
+#define XDB4_RECOVERY_WINDOW_MS			10000
+#define XDB4_WATCHDOG_PACKETS			4 /* packet periods without a completion before a stream counts as stalled */
+#define XDB4_WATCHDOG_MIN_MS			5 /* host controller scheduling alone can hold a completion back for a while */
+
+#define XDB4_TIMER_MAX_TICKS			100000 /* packets between two timer callbacks */
+#define XDB4_PERIOD_RETRY_DIV			4 /* recheck a late boundary after 1/4 packet */
 
 struct pcm_urb {
 	struct xonedb4_chip *chip;
 	struct urb instance;
-	struct usb_anchor submitted;
 	uint8_t *buffer;
+	uint8_t *frames; /* the packet as S24_3LE frames of all channels, between ALSA and device format */
+	bool clean; /* OUT buffer holds silence, apart from the MIDI bytes */
 };
 
 struct pcm_substream {
 	spinlock_t lock;
 	struct snd_pcm_substream *instance;
+	int stream; /* SNDRV_PCM_STREAM_XXX */
+	snd_pcm_format_t format;
+	unsigned int first_channel; /* device channels carried by this substream */
+	unsigned int channels;
+	unsigned int frame_bytes;
+	unsigned int packet_frames; /* frames moved per URB completion */
 
 	bool active;
 
 	snd_pcm_uframes_t dma_off; /* current position in alsa dma_area */
 	snd_pcm_uframes_t period_off; /* current position in current period */
+	unsigned int gen; /* bumped whenever the positions are reset */
+	bool busy; /* a completion handler works on a snapshot */
+
+	/* timer_periods: period wakeups paced by the device clock estimate */
+	struct pcm_runtime *rt;
+	bool timed; /* latched from timer_periods at prepare */
+	struct hrtimer period_timer;
+	ktime_t period_next; /* ideal time of the next period boundary */
+	snd_pcm_uframes_t frames; /* frames transferred since prepare */
+	snd_pcm_uframes_t period_target; /* frames at the next period boundary */
+	bool period_late; /* last boundary was reached after period_next */
+};
+
+/* notices when the URBs of one direction stop completing without an error */
+struct pcm_watchdog {
+	struct pcm_runtime *rt;
+	struct hrtimer timer;
+	int dir; /* XDB4_STATS_XXX */
+	u64 timeout; /* ns */
+	u64 last; /* ns, time of the last completion */
+};
+
+enum { /* what an URB status means for the stream */
+	URB_OK,
+	URB_STOPPED, /* unlinked or poisoned on purpose */
+	URB_RECOVER, /* transfer error, restarting the URBs helps */
+	URB_FATAL /* device is gone */
 };
 
 enum { /* pcm streaming states */
@@ -55,20 +98,73 @@ enum { /* pcm streaming states */
 
 struct pcm_runtime {
 	struct xonedb4_chip *chip;
-	struct snd_pcm *instance;
-
-	struct pcm_substream playback;
-	struct pcm_substream capture;
+	struct snd_pcm *instances[PCM_N_INSTANCES];
+
+	/* [0] is the 8 channel device, exclusive per direction with the stereo pairs after it */
+	struct pcm_substream playback[PCM_N_DEVICES];
+	struct pcm_substream capture[PCM_N_DEVICES];
+	struct pcm_substream loopback; /* the frames encoded into every OUT URB */
+	struct pcm_substream raw_playback; /* exclusive with every other substream of its direction */
+	struct pcm_substream raw_capture;
 	bool panic; /* if set driver won't do anymore pcm on device */
 
 	struct pcm_urb pcm_out_urbs[PCM_N_URBS];
 	struct pcm_urb pcm_in_urbs[PCM_N_URBS];
+	struct usb_anchor out_anchor; /* every OUT URB in flight */
+	struct usb_anchor in_anchor; /* every IN URB in flight */
+	bool capture_on; /* IN URBs run only while a capture substream is prepared */
+	uint8_t *out_silence; /* silent OUT packet in the endpoint's layout */
+	unsigned int out_packet_size;
+
+	/*
+	 * Channel routing per direction, XDB4_ROUTE_IDENTITY layout. Read once
+	 * per packet without a lock, a torn update costs at most one packet.
+	 */
+	u64 route[2]; /* indexed by SNDRV_PCM_STREAM_XXX */
+
+	struct xonedb4_clock clock; /* device clock estimate from OUT completions */
+	struct xonedb4_stats stats;
+	struct pcm_watchdog watchdog[XDB4_STATS_N_DIRS]; /* indexed by XDB4_STATS_XXX */
+
+	/*
+	 * With no substream open only pcm_out_urbs[0] runs, submitted by the
+	 * keepalive timer and chained for as long as MIDI OUT has bytes queued.
+	 */
+	spinlock_t idle_lock;
+	struct hrtimer idle_timer;
+	bool idle;
+	bool idle_busy; /* idle URB in flight */
+
+	/* ALSA timer ticking with the OUT completions, keeps the URBs out of idle while it runs */
+	struct snd_timer *timer;
+	struct work_struct timer_work;
+	bool timer_on;
+	unsigned long timer_sticks; /* packets per tick */
+	unsigned long timer_count;
+
+	/* restarts the URBs after transfer errors, see xonedb4_pcm_urb_failed */
+	struct work_struct recovery_work;
+	unsigned long recovery_start; /* jiffies, start of the rate limit window */
+	unsigned int recoveries;
 
 	struct mutex stream_mutex;
 	uint8_t stream_state; /* one of STREAM_XXX */
 	uint8_t rate; /* one of PCM_RATE_XXX */
+	unsigned int running_rate; /* Hz while the stream runs, 0 when it does not, read locklessly by the RATE rule */
 };
 
+static bool timer_periods;
+module_param(timer_periods, bool, 0644);
+MODULE_PARM_DESC(timer_periods, "Signal PCM periods from a timer following the device clock instead of from URB completions");
+
+static bool raw_pcm;
+module_param(raw_pcm, bool, 0444);
+MODULE_PARM_DESC(raw_pcm, "Add a PCM device passing device format frames (S8, 48 bytes out, 64 bytes in) through unconverted");
+
+static unsigned int idle_keepalive_ms = XDB4_IDLE_KEEPALIVE_MS;
+module_param(idle_keepalive_ms, uint, 0644);
+MODULE_PARM_DESC(idle_keepalive_ms, "Interval of the silent OUT packet sent while no PCM substream is open (1-1000 ms)");
+
 static const int rates[] = { 44100, 48000, 88200, 96000 };
 static const int rates_alsaid[] = {	SNDRV_PCM_RATE_44100, SNDRV_PCM_RATE_48000,	SNDRV_PCM_RATE_88200, SNDRV_PCM_RATE_96000 };
 
@@ -77,6 +173,7 @@ static const struct snd_pcm_hardware pcm_hw = {
 		SNDRV_PCM_INFO_INTERLEAVED |
 		SNDRV_PCM_INFO_BLOCK_TRANSFER |
 		SNDRV_PCM_INFO_PAUSE |
+		SNDRV_PCM_INFO_RESUME |
 		SNDRV_PCM_INFO_MMAP_VALID,
 
 	.formats = SNDRV_PCM_FMTBIT_S24_3LE,
@@ -91,20 +188,27 @@ static const struct snd_pcm_hardware pcm_hw = {
 	.channels_min = PCM_N_PLAYBACK_CHANNELS,
 	.channels_max = PCM_N_PLAYBACK_CHANNELS,
 	.buffer_bytes_max = ALSA_MAX_BUFSIZE,
-	.period_bytes_min = ALSA_MIN_BUFSIZE,
+	.period_bytes_min = ALSA_PCM_IN_PACKET_SIZE, /* one packet, open narrows it per direction */
 	.period_bytes_max = ALSA_MAX_BUFSIZE,
-	.periods_min = 2,
-	.periods_max = 1024
+	.periods_min = ALSA_PERIODS_MIN,
+	.periods_max = ALSA_PERIODS_MAX
 };
 
 static struct pcm_substream *xonedb4_pcm_get_substream(struct snd_pcm_substream *alsa_sub)
 {
 	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
-
-	if (alsa_sub->stream == SNDRV_PCM_STREAM_PLAYBACK) {
-		return &rt->playback;
-	} else if (alsa_sub->stream == SNDRV_PCM_STREAM_CAPTURE) {
-		return &rt->capture;
+	unsigned int device = alsa_sub->pcm->device;
+
+	if (device < PCM_N_DEVICES && alsa_sub->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+		return &rt->playback[device];
+	} else if (device < PCM_N_DEVICES && alsa_sub->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		return &rt->capture[device];
+	} else if (device == PCM_LOOPBACK_DEVICE && alsa_sub->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		return &rt->loopback;
+	} else if (device == PCM_RAW_DEVICE && alsa_sub->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+		return &rt->raw_playback;
+	} else if (device == PCM_RAW_DEVICE && alsa_sub->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		return &rt->raw_capture;
 	}
 
 	dev_err(&rt->chip->dev->dev, "%s: Error getting pcm substream slot.\n", __func__);
@@ -116,645 +220,1564 @@ static void xonedb4_pcm_stream_stop(struct pcm_runtime *rt)
 	if (rt->stream_state != STREAM_DISABLED) {
 		rt->stream_state = STREAM_STOPPING;
 		rt->stream_state = STREAM_DISABLED;
+		WRITE_ONCE(rt->running_rate, 0);
 	}
 }
 
+/* unlinks everything in flight at once, then waits for the lot */
 static void xonedb4_pcm_kill_urbs(struct pcm_runtime *rt)
 {
-	int i, time;
+	ktime_t start = ktime_get();
+	s64 left;
 
-	for (i = 0; i < PCM_N_URBS; i++) {
-		time = usb_wait_anchor_empty_timeout(&rt->pcm_in_urbs[i].submitted, 100);
-		if (!time) {
-			usb_kill_anchored_urbs(&rt->pcm_in_urbs[i].submitted);
-		}
-		time = usb_wait_anchor_empty_timeout(&rt->pcm_out_urbs[i].submitted, 100);
-		if (!time) {
-			usb_kill_anchored_urbs(&rt->pcm_out_urbs[i].submitted);
-		}
-		usb_kill_urb(&rt->pcm_in_urbs[i].instance);
-		usb_kill_urb(&rt->pcm_out_urbs[i].instance);
+	hrtimer_cancel(&rt->watchdog[XDB4_STATS_PLAYBACK].timer);
+	hrtimer_cancel(&rt->watchdog[XDB4_STATS_CAPTURE].timer);
+
+	usb_unlink_anchored_urbs(&rt->in_anchor);
+	usb_unlink_anchored_urbs(&rt->out_anchor);
+
+	if (!usb_wait_anchor_empty_timeout(&rt->in_anchor, XDB4_KILL_TIMEOUT_MS)) {
+		usb_kill_anchored_urbs(&rt->in_anchor);
 	}
+	left = XDB4_KILL_TIMEOUT_MS - ktime_ms_delta(ktime_get(), start);
+	if (!usb_wait_anchor_empty_timeout(&rt->out_anchor, max_t(s64, left, 0))) {
+		usb_kill_anchored_urbs(&rt->out_anchor);
+	}
+
+	xonedb4_stats_stop(&rt->stats, start, ktime_get());
 }
 
 static void xonedb4_pcm_poison_urbs(struct pcm_runtime *rt)
 {
-	int i, time;
+	int i;
+
+	xonedb4_pcm_kill_urbs(rt);
 
 	for (i = 0; i < PCM_N_URBS; i++) {
-		time = usb_wait_anchor_empty_timeout(&rt->pcm_in_urbs[i].submitted, 100);
-		if (!time) {
-			usb_kill_anchored_urbs(&rt->pcm_in_urbs[i].submitted);
-		}
-		time = usb_wait_anchor_empty_timeout(&rt->pcm_out_urbs[i].submitted, 100);
-		if (!time) {
-			usb_kill_anchored_urbs(&rt->pcm_out_urbs[i].submitted);
-		}
 		usb_poison_urb(&rt->pcm_in_urbs[i].instance);
 		usb_poison_urb(&rt->pcm_out_urbs[i].instance);
 	}
 }
 
-/* call with stream_mutex locked */
-static int xonedb4_pcm_stream_start(struct pcm_runtime *rt)
+/* call with stream_mutex locked, the URBs of the direction were just submitted */
+static void xonedb4_pcm_watchdog_start(struct pcm_runtime *rt, int dir, unsigned int frames)
 {
-	int ret = 0;
-	
-	if (rt->stream_state == STREAM_DISABLED) {
-		/* reset panic state when starting a new stream */
-		rt->panic = false;
-		rt->stream_state = STREAM_STARTING;
-		rt->stream_state = STREAM_RUNNING;
+	struct pcm_watchdog *wd = &rt->watchdog[dir];
+	u64 packet = div_u64((u64) frames * NSEC_PER_SEC, rates[rt->chip->devicerate]);
+
+	wd->timeout = max_t(u64, XDB4_WATCHDOG_PACKETS * packet, XDB4_WATCHDOG_MIN_MS * NSEC_PER_MSEC);
+	WRITE_ONCE(wd->last, ktime_get_ns());
+	hrtimer_start(&wd->timer, ns_to_ktime(wd->timeout), HRTIMER_MODE_REL);
+}
+
+static int xonedb4_pcm_submit_urb(struct pcm_urb *urb, struct usb_anchor *anchor)
+{
+	int ret;
+
+	usb_anchor_urb(&urb->instance, anchor);
+	ret = usb_submit_urb(&urb->instance, GFP_ATOMIC);
+	if (ret < 0) {
+		usb_unanchor_urb(&urb->instance);
 	}
+
 	return ret;
 }
 
-static int xonedb4_pcm_set_rate(struct pcm_runtime *rt)
+/* call with stream_mutex locked */
+static int xonedb4_pcm_submit_urbs(struct pcm_runtime *rt)
 {
-	rt->chip->alsarate = rt->rate;
+	uint8_t i;
+	int ret;
 
-	if (rt->chip->alsarate != rt->chip->devicerate) {
-		dev_notice(&rt->chip->dev->dev, "%s: Resetting device for samplerate change %d -> %d\n", __func__, rates[rt->chip->devicerate], rates[rt->chip->alsarate]);
-		mutex_unlock(&rt->stream_mutex);
-		xonedb4_reset(rt->chip);
-		mutex_lock(&rt->stream_mutex);
+	for (i = 0; i < PCM_N_URBS && rt->capture_on; i++) {
+		ret = xonedb4_pcm_submit_urb(&rt->pcm_in_urbs[i], &rt->in_anchor);
+		if (ret < 0) {
+			goto error;
+		}
+	}
+
+	for (i = 0; i < PCM_N_URBS; i++) {
+		ret = xonedb4_pcm_submit_urb(&rt->pcm_out_urbs[i], &rt->out_anchor);
+		if (ret < 0) {
+			goto error;
+		}
 	}
 
+	xonedb4_pcm_watchdog_start(rt, XDB4_STATS_PLAYBACK, XDB4_PCM_OUT_FRAMES_PER_PACKET);
+	if (rt->capture_on)
+		xonedb4_pcm_watchdog_start(rt, XDB4_STATS_CAPTURE, XDB4_PCM_IN_FRAMES_PER_PACKET);
+
 	return 0;
+
+	error:
+	xonedb4_pcm_stream_stop(rt);
+	xonedb4_pcm_kill_urbs(rt);
+	return ret;
 }
 
-/* call with substream locked */
-/* returns true if a period elapsed */
-static bool xonedb4_pcm_capture(struct pcm_substream *sub, struct pcm_urb *urb)
+/* call with stream_mutex locked */
+static void xonedb4_pcm_stop_capture(struct pcm_runtime *rt)
 {
-	struct snd_pcm_runtime *alsa_rt = sub->instance->runtime;
-	unsigned int pcm_buffer_size;
+	if (!rt->capture_on)
+		return;
+
+	/* the IN handler stops resubmitting, then whatever is in flight gets unlinked */
+	rt->capture_on = false;
+	hrtimer_cancel(&rt->watchdog[XDB4_STATS_CAPTURE].timer);
+	usb_unlink_anchored_urbs(&rt->in_anchor);
+	if (!usb_wait_anchor_empty_timeout(&rt->in_anchor, XDB4_KILL_TIMEOUT_MS)) {
+		usb_kill_anchored_urbs(&rt->in_anchor);
+	}
+}
 
-	pcm_buffer_size = snd_pcm_lib_buffer_bytes(sub->instance);
+/* call with stream_mutex locked, PCM OUT must be streaming already */
+static int xonedb4_pcm_start_capture(struct pcm_runtime *rt)
+{
+	uint8_t i;
+	int ret;
 
-	if (sub->dma_off + ALSA_PCM_IN_PACKET_SIZE <= pcm_buffer_size) {
-		dev_dbg(&urb->chip->dev->dev, "%s: (1) buffer_size %#x dma_offset %#x\n", __func__, (unsigned int) pcm_buffer_size, (unsigned int) sub->dma_off);
+	if (rt->capture_on)
+		return 0;
 
-		uint8_t curframe = 0;
-		uint8_t *src = urb->buffer;
-		uint8_t *dest = alsa_rt->dma_area + sub->dma_off;
+	rt->capture_on = true;
+	xonedb4_stats_restart(&rt->stats.dir[XDB4_STATS_CAPTURE], rates[rt->chip->devicerate], XDB4_PCM_IN_FRAMES_PER_PACKET);
 
-		for (curframe = 0; curframe < XDB4_PCM_IN_FRAMES_PER_PACKET; curframe++) {
-			ploytec_convert_to_s24_3le(dest + (curframe * ALSA_BYTES_PER_FRAME), src + (curframe * XDB4_PCM_IN_FRAME_SIZE));
-		}
-	} else {
-		/* wrap around at end of ring buffer */
-		dev_dbg(&urb->chip->dev->dev, "%s: (2) buffer_size %#x dma_offset %#x\n", __func__, (unsigned int) pcm_buffer_size, (unsigned int) sub->dma_off);
-
-		uint8_t curframexone = 0;
-		uint8_t curframealsa1 = 0;
-		uint8_t curframealsa2 = 0;
-		uint8_t numframesalsa1 = (pcm_buffer_size - sub->dma_off) / ((uint32_t) ALSA_BYTES_PER_FRAME);
-		uint8_t numframesalsa2 = XDB4_PCM_OUT_FRAMES_PER_PACKET - numframesalsa1;
-		uint8_t *src = urb->buffer;
-		uint8_t *dest1 = alsa_rt->dma_area + sub->dma_off;
-		uint8_t *dest2 = alsa_rt->dma_area;
-
-		for (curframexone = 0; curframexone < XDB4_PCM_IN_FRAMES_PER_PACKET; curframexone++) {
-			if (curframealsa1 < numframesalsa1) {
-				ploytec_convert_to_s24_3le(dest1 + (curframealsa1 * ALSA_BYTES_PER_FRAME), src + (curframexone * XDB4_PCM_IN_FRAME_SIZE));
-				curframealsa1++;
-			} else if (curframealsa2 < numframesalsa2) {
-				ploytec_convert_to_s24_3le(dest2 + (curframealsa2 * ALSA_BYTES_PER_FRAME), src + (curframexone * XDB4_PCM_IN_FRAME_SIZE));
-				curframealsa2++;
-			}
+	for (i = 0; i < PCM_N_URBS; i++) {
+		ret = xonedb4_pcm_submit_urb(&rt->pcm_in_urbs[i], &rt->in_anchor);
+		if (ret < 0) {
+			dev_err(&rt->chip->dev->dev, "%s: Cannot submit capture URB: %d\n", __func__, ret);
+			xonedb4_pcm_stop_capture(rt);
+			return ret;
 		}
 	}
-	sub->dma_off += ALSA_PCM_IN_PACKET_SIZE;
-	if (sub->dma_off >= pcm_buffer_size) {
-		sub->dma_off -= pcm_buffer_size;
-	}
 
-	sub->period_off += ALSA_PCM_IN_PACKET_SIZE;
-	if (sub->period_off >= alsa_rt->period_size) {
-		sub->period_off %= alsa_rt->period_size;
-		return true;
-	}
+	xonedb4_pcm_watchdog_start(rt, XDB4_STATS_CAPTURE, XDB4_PCM_IN_FRAMES_PER_PACKET);
 
-	return false;
+	return 0;
 }
 
-/* call with substream locked */
-/* returns true if a period elapsed */
-static bool xonedb4_pcm_bulk_playback(struct pcm_substream *sub, struct pcm_urb *urb)
+/* the URBs (re)start at chip->devicerate */
+static void xonedb4_pcm_reset_timing(struct pcm_runtime *rt)
 {
-	struct snd_pcm_runtime *alsa_rt = sub->instance->runtime;
-	uint32_t pcm_buffer_size = snd_pcm_lib_buffer_bytes(sub->instance);
-
-	if (sub->dma_off + ALSA_PCM_OUT_PACKET_SIZE <= pcm_buffer_size) {
-		dev_dbg(&urb->chip->dev->dev, "%s: (1) buffer_size %#x dma_offset %#x\n", __func__, (unsigned int) pcm_buffer_size, (unsigned int) sub->dma_off);
+	unsigned int rate = rates[rt->chip->devicerate];
 
-		uint8_t curframe = 0;
-		uint8_t *src = urb->buffer;
-		uint8_t *dest = alsa_rt->dma_area + sub->dma_off;
-
-		for (curframe = 0; curframe < 10; curframe++) {
-			ploytec_convert_from_s24_3le(src + (curframe * XDB4_PCM_OUT_FRAME_SIZE), dest + (curframe * ALSA_BYTES_PER_FRAME));
-		}
-		for (curframe = 10; curframe < 20; curframe++) {
-			ploytec_convert_from_s24_3le(src + (curframe * XDB4_PCM_OUT_FRAME_SIZE) + 32, dest + (curframe * ALSA_BYTES_PER_FRAME));
-		}
-		for (curframe = 20; curframe < 30; curframe++) {
-			ploytec_convert_from_s24_3le(src + (curframe * XDB4_PCM_OUT_FRAME_SIZE) + 64, dest + (curframe * ALSA_BYTES_PER_FRAME));
-		}
-		for (curframe = 30; curframe < 40; curframe++) {
-			ploytec_convert_from_s24_3le(src + (curframe * XDB4_PCM_OUT_FRAME_SIZE) + 96, dest + (curframe * ALSA_BYTES_PER_FRAME));
-		}
-	} else {
-		/* wrap around at end of ring buffer */
-		dev_dbg(&urb->chip->dev->dev, "%s: (2) buffer_size %#x dma_offset %#x\n", __func__, (unsigned int) pcm_buffer_size, (unsigned int) sub->dma_off);
-
-		uint8_t curframexone = 0;
-		uint8_t curframealsa1 = 0;
-		uint8_t curframealsa2 = 0;
-		uint8_t numframesalsa1 = (pcm_buffer_size - sub->dma_off) / ((uint32_t) ALSA_BYTES_PER_FRAME);
-		uint8_t numframesalsa2 = XDB4_PCM_OUT_FRAMES_PER_PACKET - numframesalsa1;
-		uint8_t *src = urb->buffer;
-		uint8_t *dest1 = alsa_rt->dma_area + sub->dma_off;
-		uint8_t *dest2 = alsa_rt->dma_area;
-
-		for (curframexone = 0; curframexone < 10; curframexone++) {
-			if (curframealsa1 < numframesalsa1) {
-				ploytec_convert_from_s24_3le(src + (curframexone * XDB4_PCM_OUT_FRAME_SIZE), dest1 + (curframealsa1 * ALSA_BYTES_PER_FRAME));
-				curframealsa1++;
-			} else if (curframealsa2 < numframesalsa2) {
-				ploytec_convert_from_s24_3le(src + (curframexone * XDB4_PCM_OUT_FRAME_SIZE), dest2 + (curframealsa2 * ALSA_BYTES_PER_FRAME));
-				curframealsa2++;
-			}
-		}
-		for (curframexone = 10; curframexone < 20; curframexone++) {
-			if (curframealsa1 < numframesalsa1) {
-				ploytec_convert_from_s24_3le(src + (curframexone * XDB4_PCM_OUT_FRAME_SIZE) + 32, dest1 + (curframealsa1 * ALSA_BYTES_PER_FRAME));
-				curframealsa1++;
-			} else if (curframealsa2 < numframesalsa2) {
-				ploytec_convert_from_s24_3le(src + (curframexone * XDB4_PCM_OUT_FRAME_SIZE) + 32, dest2 + (curframealsa2 * ALSA_BYTES_PER_FRAME));
-				curframealsa2++;
-			}
-		}
-		for (curframexone = 20; curframexone < 30; curframexone++) {
-			if (curframealsa1 < numframesalsa1) {
-				ploytec_convert_from_s24_3le(src + (curframexone * XDB4_PCM_OUT_FRAME_SIZE) + 64, dest1 + (curframealsa1 * ALSA_BYTES_PER_FRAME));
-				curframealsa1++;
-			} else if (curframealsa2 < numframesalsa2) {
-				ploytec_convert_from_s24_3le(src + (curframexone * XDB4_PCM_OUT_FRAME_SIZE) + 64, dest2 + (curframealsa2 * ALSA_BYTES_PER_FRAME));
-				curframealsa2++;
-			}
-		}
-		for (curframexone = 30; curframexone < 40; curframexone++) {
-			if (curframealsa1 < numframesalsa1) {
-				ploytec_convert_from_s24_3le(src + (curframexone * XDB4_PCM_OUT_FRAME_SIZE) + 96, dest1 + (curframealsa1 * ALSA_BYTES_PER_FRAME));
-				curframealsa1++;
-			} else if (curframealsa2 < numframesalsa2) {
-				ploytec_convert_from_s24_3le(src + (curframexone * XDB4_PCM_OUT_FRAME_SIZE) + 96, dest2 + (curframealsa2 * ALSA_BYTES_PER_FRAME));
-				curframealsa2++;
-			}
-		}
-	}
-	sub->dma_off += ALSA_PCM_OUT_PACKET_SIZE;
-	if (sub->dma_off >= pcm_buffer_size) {
-		sub->dma_off -= pcm_buffer_size;
-	}
+	xonedb4_clock_reset(&rt->clock, rate, XDB4_PCM_OUT_FRAMES_PER_PACKET);
+	xonedb4_stats_restart(&rt->stats.dir[XDB4_STATS_PLAYBACK], rate, XDB4_PCM_OUT_FRAMES_PER_PACKET);
+	xonedb4_stats_restart(&rt->stats.dir[XDB4_STATS_CAPTURE], rate, XDB4_PCM_IN_FRAMES_PER_PACKET);
+}
 
-	sub->period_off += ALSA_PCM_OUT_PACKET_SIZE;
-	if (sub->period_off >= alsa_rt->period_size) {
-		sub->period_off %= alsa_rt->period_size;
-		return true;
-	}
+/* call with stream_mutex locked, keeps the completion handlers from flagging the unlinks as a panic */
+static void xonedb4_pcm_halt_urbs(struct pcm_runtime *rt)
+{
+	uint8_t stream_state = rt->stream_state;
 
-	return false;
+	rt->stream_state = STREAM_STOPPING;
+	xonedb4_pcm_kill_urbs(rt);
+	rt->stream_state = stream_state;
 }
 
-/* call with substream locked */
-/* returns true if a period elapsed */
-static bool xonedb4_pcm_int_playback(struct pcm_substream *sub, struct pcm_urb *urb)
+/* called from the OUT handlers for every streamed packet */
+static void xonedb4_pcm_timer_tick(struct pcm_runtime *rt)
 {
-	struct snd_pcm_runtime *alsa_rt = sub->instance->runtime;
-	uint32_t pcm_buffer_size = snd_pcm_lib_buffer_bytes(sub->instance);
+	if (!READ_ONCE(rt->timer_on))
+		return;
 
-	if (sub->dma_off + ALSA_PCM_OUT_PACKET_SIZE <= pcm_buffer_size) {
-		dev_dbg(&urb->chip->dev->dev, "%s: (1) buffer_size %#x dma_offset %#x\n", __func__, (unsigned int) pcm_buffer_size, (unsigned int) sub->dma_off);
+	if (++rt->timer_count >= rt->timer_sticks) {
+		rt->timer_count = 0;
+		snd_timer_interrupt(rt->timer, rt->timer_sticks);
+	}
+}
 
-		uint8_t curframe = 0;
-		uint8_t *src = urb->buffer;
-		uint8_t *dest = alsa_rt->dma_area + sub->dma_off;
+/* fills in the MIDI OUT bytes of the next packet */
+static void xonedb4_pcm_out_midi(struct pcm_urb *out_urb)
+{
+	if (usb_pipebulk(out_urb->instance.pipe)) {
+		xonedb4_get_midi_output(out_urb->chip, out_urb->buffer + 480, 1);
+		xonedb4_get_midi_output(out_urb->chip, out_urb->buffer + 992, 1);
+		xonedb4_get_midi_output(out_urb->chip, out_urb->buffer + 1504, 1);
+		xonedb4_get_midi_output(out_urb->chip, out_urb->buffer + 2016, 1);
+	} else {
+		xonedb4_get_midi_output(out_urb->chip, out_urb->buffer + 432, 2);
+		xonedb4_get_midi_output(out_urb->chip, out_urb->buffer + 914, 2);
+		xonedb4_get_midi_output(out_urb->chip, out_urb->buffer + 1396, 2);
+		xonedb4_get_midi_output(out_urb->chip, out_urb->buffer + 1878, 2);
+	}
+}
 
-		for (curframe = 0; curframe < 9; curframe++) {
-			ploytec_convert_from_s24_3le(src + (curframe * XDB4_PCM_OUT_FRAME_SIZE) + 0, dest + (curframe * ALSA_BYTES_PER_FRAME));
-		}
-		for (curframe = 9; curframe < 19; curframe++) {
-			ploytec_convert_from_s24_3le(src + (curframe * XDB4_PCM_OUT_FRAME_SIZE) + 2, dest + (curframe * ALSA_BYTES_PER_FRAME));
-		}
-		for (curframe = 19; curframe < 29; curframe++) {
-			ploytec_convert_from_s24_3le(src + (curframe * XDB4_PCM_OUT_FRAME_SIZE) + 4, dest + (curframe * ALSA_BYTES_PER_FRAME));
-		}
-		for (curframe = 29; curframe < 39; curframe++) {
-			ploytec_convert_from_s24_3le(src + (curframe * XDB4_PCM_OUT_FRAME_SIZE) + 6, dest + (curframe * ALSA_BYTES_PER_FRAME));
-		}
-		for (curframe = 39; curframe < 40; curframe++) {
-			ploytec_convert_from_s24_3le(src + (curframe * XDB4_PCM_OUT_FRAME_SIZE) + 8, dest + (curframe * ALSA_BYTES_PER_FRAME));
+/* one completion into the flight recorder, pos is the first running substream or NULL */
+static void xonedb4_pcm_record(struct pcm_runtime *rt, u8 kind, struct pcm_urb *urb, int status, const struct xonedb4_position *pos, unsigned int frames)
+{
+	static const u16 bulk_midi[] = { 480, 992, 1504, 2016 };
+	static const u16 int_midi[] = { 432, 433, 914, 915, 1396, 1397, 1878, 1879 };
+	struct xonedb4_record r = {
+		.kind = kind,
+		.status = status,
+		.length = urb->instance.actual_length,
+		.time = ktime_get_ns()
+	};
+	const u16 *midi;
+	unsigned int i;
+
+	if (kind == XDB4_REC_PCM_OUT) {
+		r.index = urb - rt->pcm_out_urbs;
+		if (usb_pipebulk(urb->instance.pipe)) {
+			midi = bulk_midi;
+			r.n_midi = ARRAY_SIZE(bulk_midi);
+		} else {
+			midi = int_midi;
+			r.n_midi = ARRAY_SIZE(int_midi);
 		}
+		for (i = 0; i < r.n_midi; i++)
+			r.midi[i] = urb->buffer[midi[i]];
 	} else {
-		/* wrap around at end of ring buffer */
-		dev_dbg(&urb->chip->dev->dev, "%s: (2) buffer_size %#x dma_offset %#x\n", __func__, (unsigned int) pcm_buffer_size, (unsigned int) sub->dma_off);
-
-		uint8_t curframexone = 0;
-		uint8_t curframealsa1 = 0;
-		uint8_t curframealsa2 = 0;
-		uint8_t numframesalsa1 = (pcm_buffer_size - sub->dma_off) / ((uint32_t) ALSA_BYTES_PER_FRAME);
-		uint8_t numframesalsa2 = XDB4_PCM_OUT_FRAMES_PER_PACKET - numframesalsa1;
-		uint8_t *src = urb->buffer;
-		uint8_t *dest1 = alsa_rt->dma_area + sub->dma_off;
-		uint8_t *dest2 = alsa_rt->dma_area;
-
-		for (curframexone = 0; curframexone < 9; curframexone++) {
-			if (curframealsa1 < numframesalsa1) {
-				ploytec_convert_from_s24_3le(src + (curframexone * XDB4_PCM_OUT_FRAME_SIZE) + 0, dest1 + (curframealsa1 * ALSA_BYTES_PER_FRAME));
-				curframealsa1++;
-			} else if (curframealsa2 < numframesalsa2) {
-				ploytec_convert_from_s24_3le(src + (curframexone * XDB4_PCM_OUT_FRAME_SIZE) + 0, dest2 + (curframealsa2 * ALSA_BYTES_PER_FRAME));
-				curframealsa2++;
-			}
-		}
-		for (curframexone = 9; curframexone < 19; curframexone++) {
-			if (curframealsa1 < numframesalsa1) {
-				ploytec_convert_from_s24_3le(src + (curframexone * XDB4_PCM_OUT_FRAME_SIZE) + 2, dest1 + (curframealsa1 * ALSA_BYTES_PER_FRAME));
-				curframealsa1++;
-			} else if (curframealsa2 < numframesalsa2) {
-				ploytec_convert_from_s24_3le(src + (curframexone * XDB4_PCM_OUT_FRAME_SIZE) + 2, dest2 + (curframealsa2 * ALSA_BYTES_PER_FRAME));
-				curframealsa2++;
-			}
-		}
-		for (curframexone = 19; curframexone < 29; curframexone++) {
-			if (curframealsa1 < numframesalsa1) {
-				ploytec_convert_from_s24_3le(src + (curframexone * XDB4_PCM_OUT_FRAME_SIZE) + 4, dest1 + (curframealsa1 * ALSA_BYTES_PER_FRAME));
-				curframealsa1++;
-			} else if (curframealsa2 < numframesalsa2) {
-				ploytec_convert_from_s24_3le(src + (curframexone * XDB4_PCM_OUT_FRAME_SIZE) + 4, dest2 + (curframealsa2 * ALSA_BYTES_PER_FRAME));
-				curframealsa2++;
-			}
-		}
-		for (curframexone = 29; curframexone < 39; curframexone++) {
-			if (curframealsa1 < numframesalsa1) {
-				ploytec_convert_from_s24_3le(src + (curframexone * XDB4_PCM_OUT_FRAME_SIZE) + 6, dest1 + (curframealsa1 * ALSA_BYTES_PER_FRAME));
-				curframealsa1++;
-			} else if (curframealsa2 < numframesalsa2) {
-				ploytec_convert_from_s24_3le(src + (curframexone * XDB4_PCM_OUT_FRAME_SIZE) + 6, dest2 + (curframealsa2 * ALSA_BYTES_PER_FRAME));
-				curframealsa2++;
-			}
-		}
-		for (curframexone = 39; curframexone < 40; curframexone++) {
-			if (curframealsa1 < numframesalsa1) {
-				ploytec_convert_from_s24_3le(src + (curframexone * XDB4_PCM_OUT_FRAME_SIZE) + 8, dest1 + (curframealsa1 * ALSA_BYTES_PER_FRAME));
-				curframealsa1++;
-			} else if (curframealsa2 < numframesalsa2) {
-				ploytec_convert_from_s24_3le(src + (curframexone * XDB4_PCM_OUT_FRAME_SIZE) + 8, dest2 + (curframealsa2 * ALSA_BYTES_PER_FRAME));
-				curframealsa2++;
-			}
-		}
-	}
-	sub->dma_off += ALSA_PCM_OUT_PACKET_SIZE;
-	if (sub->dma_off >= pcm_buffer_size) {
-		sub->dma_off -= pcm_buffer_size;
+		r.index = urb - rt->pcm_in_urbs;
 	}
 
-	sub->period_off += ALSA_PCM_OUT_PACKET_SIZE;
-	if (sub->period_off >= alsa_rt->period_size) {
-		sub->period_off %= alsa_rt->period_size;
-		return true;
+	if (pos) {
+		r.dma_before = pos->dma_off;
+		r.dma_after = xonedb4_frames_next(pos, frames);
 	}
 
-	return false;
+	xonedb4_recorder_add(rt->chip->recorder, &r);
 }
 
-static void xonedb4_pcm_in_urb_handler(struct urb *usb_urb)
+/* the MIDI bytes get overwritten too, fill them in afterwards */
+static void xonedb4_pcm_out_silence(struct pcm_runtime *rt, struct pcm_urb *out_urb)
 {
-	struct pcm_urb *in_urb = usb_urb->context;
-	struct pcm_runtime *rt = in_urb->chip->pcm;
-	struct pcm_substream *sub;
-	bool do_period_elapsed = false;
-	unsigned long flags;
+	memcpy(out_urb->buffer, rt->out_silence, rt->out_packet_size);
+	out_urb->clean = true;
+}
+
+/* call with idle_lock held */
+static void xonedb4_pcm_idle_submit(struct pcm_runtime *rt)
+{
+	struct pcm_urb *out_urb = &rt->pcm_out_urbs[0];
 	int ret;
 
-	if (rt->panic || rt->stream_state == STREAM_STOPPING)
+	if (!rt->idle || rt->idle_busy)
 		return;
 
-	if (unlikely(usb_urb->status == -ENOENT ||	/* unlinked */
-		     usb_urb->status == -ENODEV ||	/* device removed */
-		     usb_urb->status == -ECONNRESET ||	/* unlinked */
-		     usb_urb->status == -ESHUTDOWN)) {	/* device disabled */
-		goto in_fail;
+	ret = xonedb4_pcm_submit_urb(out_urb, &rt->out_anchor);
+	if (ret < 0) {
+		dev_err_ratelimited(&rt->chip->dev->dev, "%s: Cannot submit idle URB: %d\n", __func__, ret);
+		return;
 	}
 
-	sub = &rt->capture;
-	spin_lock_irqsave(&sub->lock, flags);
-	if (sub->active) {
-		do_period_elapsed = xonedb4_pcm_capture(sub, in_urb);
-	} else {
-		memset(in_urb->buffer, 0, XDB4_PCM_IN_PACKET_SIZE);
-	}
-	spin_unlock_irqrestore(&sub->lock, flags);
+	rt->idle_busy = true;
+}
 
-	if (do_period_elapsed) {
-		snd_pcm_period_elapsed(sub->instance);
-	}
+static ktime_t xonedb4_pcm_keepalive_interval(void)
+{
+	return ms_to_ktime(clamp_t(unsigned int, READ_ONCE(idle_keepalive_ms), 1, XDB4_IDLE_KEEPALIVE_MAX_MS));
+}
 
-	ret = usb_submit_urb(&in_urb->instance, GFP_ATOMIC);
+static enum hrtimer_restart xonedb4_pcm_idle_keepalive(struct hrtimer *timer)
+{
+	struct pcm_runtime *rt = container_of(timer, struct pcm_runtime, idle_timer);
+	unsigned long flags;
 
-	if (ret < 0)
-		goto in_fail;
+	spin_lock_irqsave(&rt->idle_lock, flags);
+	xonedb4_pcm_idle_submit(rt);
+	spin_unlock_irqrestore(&rt->idle_lock, flags);
 
-	return;
+	hrtimer_forward_now(timer, xonedb4_pcm_keepalive_interval());
+	return HRTIMER_RESTART;
+}
 
-in_fail:
-	dev_err(&in_urb->chip->dev->dev, "%s: IN FAIL\n", __func__);
-	rt->panic = true;
+/* idle OUT completion, runs instead of the streaming path */
+static void xonedb4_pcm_idle_complete(struct pcm_runtime *rt, struct pcm_urb *out_urb)
+{
+	unsigned long flags;
+	bool pending;
+
+	spin_lock_irqsave(&rt->idle_lock, flags);
+	rt->idle_busy = false;
+	pending = xonedb4_midi_pending(out_urb->chip);
+	xonedb4_pcm_out_midi(out_urb);
+	xonedb4_pcm_record(rt, XDB4_REC_PCM_OUT, out_urb, 0, NULL, 0);
+	if (pending) {
+		xonedb4_pcm_idle_submit(rt);
+	}
+	spin_unlock_irqrestore(&rt->idle_lock, flags);
 }
 
-static void xonedb4_pcm_bulk_out_urb_handler(struct urb *usb_urb)
+/* called by MIDI OUT when bytes got queued, so they don't wait for the keepalive */
+void xonedb4_pcm_kick_midi(struct xonedb4_chip *chip)
 {
-	struct pcm_urb *out_urb = usb_urb->context;
-	struct pcm_runtime *rt = out_urb->chip->pcm;
-	struct pcm_substream *sub;
-	bool do_period_elapsed = false;
+	struct pcm_runtime *rt = chip->pcm;
 	unsigned long flags;
-	int ret;
 
-	if (rt->panic || rt->stream_state == STREAM_STOPPING)
+	if (!rt)
 		return;
 
-	if (unlikely(usb_urb->status == -ENOENT || usb_urb->status == -ENODEV || usb_urb->status == -ECONNRESET || usb_urb->status == -ESHUTDOWN)) {
-		goto out_fail;
-	}
-
-	sub = &rt->playback;
-
-	spin_lock_irqsave(&sub->lock, flags);
-	if (sub->active) {
-		do_period_elapsed = xonedb4_pcm_bulk_playback(sub, out_urb);
-	} else {
-		memset(out_urb->buffer + 0, 0, 480);
-		memset(out_urb->buffer + 512, 0, 480);
-		memset(out_urb->buffer + 1024, 0, 480);
-		memset(out_urb->buffer + 1536, 0, 480);
+	spin_lock_irqsave(&rt->idle_lock, flags);
+	if (rt->idle && !rt->idle_busy) {
+		xonedb4_pcm_out_midi(&rt->pcm_out_urbs[0]);
+		xonedb4_pcm_idle_submit(rt);
 	}
-	spin_unlock_irqrestore(&sub->lock, flags);
+	spin_unlock_irqrestore(&rt->idle_lock, flags);
+}
 
-	if (do_period_elapsed) {
-		snd_pcm_period_elapsed(sub->instance);
-	}
+/* call with stream_mutex locked */
+static void xonedb4_pcm_enter_idle(struct pcm_runtime *rt)
+{
+	unsigned long flags;
 
-	xonedb4_get_midi_output(out_urb->buffer + 480, 1);
-	xonedb4_get_midi_output(out_urb->buffer + 992, 1);
-	xonedb4_get_midi_output(out_urb->buffer + 1504, 1);
-	xonedb4_get_midi_output(out_urb->buffer + 2016, 1);
+	if (rt->idle)
+		return;
 
-	ret = usb_submit_urb(&out_urb->instance, GFP_ATOMIC);
+	xonedb4_pcm_halt_urbs(rt);
+	xonedb4_pcm_reset_timing(rt);
 
-	if (ret < 0)
-		goto out_fail;
+	/* idle completions never touch the audio, start from silence */
+	if (!rt->pcm_out_urbs[0].clean) {
+		xonedb4_pcm_out_silence(rt, &rt->pcm_out_urbs[0]);
+		xonedb4_pcm_out_midi(&rt->pcm_out_urbs[0]);
+	}
 
-	return;
+	spin_lock_irqsave(&rt->idle_lock, flags);
+	rt->idle = true;
+	rt->idle_busy = false;
+	xonedb4_pcm_idle_submit(rt);
+	spin_unlock_irqrestore(&rt->idle_lock, flags);
 
-out_fail:
-	dev_err(&out_urb->chip->dev->dev, "%s: OUT FAIL\n", __func__);
-	rt->panic = true;
+	hrtimer_start(&rt->idle_timer, xonedb4_pcm_keepalive_interval(), HRTIMER_MODE_REL);
+	dev_dbg(&rt->chip->dev->dev, "%s: PCM idle\n", __func__);
 }
 
-static void xonedb4_pcm_int_out_urb_handler(struct urb *usb_urb)
+/* call with stream_mutex locked, back to full streaming */
+static int xonedb4_pcm_leave_idle(struct pcm_runtime *rt)
 {
-	struct pcm_urb *out_urb = usb_urb->context;
-	struct pcm_runtime *rt = out_urb->chip->pcm;
-	struct pcm_substream *sub;
-	bool do_period_elapsed = false;
 	unsigned long flags;
+	ktime_t start = ktime_get();
 	int ret;
 
-	if (rt->panic || rt->stream_state == STREAM_STOPPING)
-		return;
+	if (!rt->idle)
+		return 0;
 
-	if (unlikely(usb_urb->status == -ENOENT || usb_urb->status == -ENODEV || usb_urb->status == -ECONNRESET || usb_urb->status == -ESHUTDOWN)) {
-		goto out_fail;
+	hrtimer_cancel(&rt->idle_timer);
+
+	spin_lock_irqsave(&rt->idle_lock, flags);
+	rt->idle = false;
+	spin_unlock_irqrestore(&rt->idle_lock, flags);
+
+	/* at most one packet in flight */
+	xonedb4_pcm_halt_urbs(rt);
+	rt->idle_busy = false;
+
+	xonedb4_pcm_reset_timing(rt);
+	ret = xonedb4_pcm_submit_urbs(rt);
+
+	dev_dbg(&rt->chip->dev->dev, "%s: PCM streaming after %lld us\n", __func__, ktime_us_delta(ktime_get(), start));
+	return ret;
+}
+
+/* call with stream_mutex locked */
+static int xonedb4_pcm_stream_start(struct pcm_runtime *rt)
+{
+	int ret = 0;
+	
+	if (rt->stream_state == STREAM_DISABLED) {
+		/* reset panic state when starting a new stream */
+		rt->panic = false;
+		rt->stream_state = STREAM_STARTING;
+		rt->stream_state = STREAM_RUNNING;
+		WRITE_ONCE(rt->running_rate, rates[rt->rate]);
 	}
+	return ret;
+}
 
-	sub = &rt->playback;
+/* call with stream_mutex locked */
+static int xonedb4_pcm_set_rate(struct pcm_runtime *rt)
+{
+	struct xonedb4_chip *chip = rt->chip;
+	int ret, submit_ret;
 
-	spin_lock_irqsave(&sub->lock, flags);
-	if (sub->active) {
-		do_period_elapsed = xonedb4_pcm_int_playback(sub, out_urb);
-	} else {
-		memset(out_urb->buffer + 0, 0, 432);
-		memset(out_urb->buffer + 434, 0, 480);
-		memset(out_urb->buffer + 916, 0, 480);
-		memset(out_urb->buffer + 1398, 0, 480);
-		memset(out_urb->buffer + 1880, 0, 48);
+	chip->alsarate = rt->rate;
+
+	if (chip->alsarate == chip->devicerate) {
+		return 0;
 	}
-	spin_unlock_irqrestore(&sub->lock, flags);
 
-	if (do_period_elapsed) {
-		snd_pcm_period_elapsed(sub->instance);
+	dev_notice(&chip->dev->dev, "%s: Switching samplerate %d -> %d\n", __func__, rates[chip->devicerate], rates[chip->alsarate]);
+
+	/* let the completion handlers run dry, MIDI IN keeps going on its own endpoint */
+	rt->stream_state = STREAM_STOPPING;
+	xonedb4_pcm_kill_urbs(rt);
+
+	ret = xonedb4_init_device(chip);
+	if (ret < 0) {
+		dev_err(&chip->dev->dev, "%s: Samplerate switch failed!\n", __func__);
 	}
 
-	xonedb4_get_midi_output(out_urb->buffer + 432, 2);
-	xonedb4_get_midi_output(out_urb->buffer + 914, 2);
-	xonedb4_get_midi_output(out_urb->buffer + 1396, 2);
-	xonedb4_get_midi_output(out_urb->buffer + 1878, 2);
+	xonedb4_pcm_reset_timing(rt);
+	rt->stream_state = STREAM_DISABLED;
 
-	ret = usb_submit_urb(&out_urb->instance, GFP_ATOMIC);
-	
-	if (ret < 0)
-		goto out_fail;
+	/* restart at whatever rate the device ended up with, MIDI OUT rides on these URBs */
+	submit_ret = xonedb4_pcm_submit_urbs(rt);
 
-	return;
+	return ret < 0 ? ret : submit_ret;
+}
 
-out_fail:
-	dev_err(&out_urb->chip->dev->dev, "%s: OUT FAIL\n", __func__);
-	rt->panic = true;
+/* call with substream locked */
+/* returns false if the substream isn't running */
+static bool xonedb4_pcm_snapshot(struct pcm_substream *sub, struct xonedb4_position *pos)
+{
+	if (!sub->active)
+		return false;
+
+	pos->dma_area = sub->instance->runtime->dma_area;
+	pos->buffer_size = snd_pcm_lib_buffer_bytes(sub->instance);
+	pos->dma_off = sub->dma_off;
+	pos->gen = sub->gen;
+	pos->frame_bytes = frames_to_bytes(sub->instance->runtime, 1);
+	pos->first_channel = sub->first_channel;
+	pos->channels = sub->channels;
+	sub->busy = true;
+
+	return true;
 }
 
-static int xonedb4_pcm_open(struct snd_pcm_substream *alsa_sub)
+/* call with substream locked */
+/* returns true if a period elapsed */
+static bool xonedb4_pcm_commit(struct pcm_substream *sub, const struct xonedb4_position *pos, unsigned int frames)
 {
-	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
-	struct pcm_substream *sub = NULL;
-	struct snd_pcm_runtime *alsa_rt = alsa_sub->runtime;
+	struct snd_pcm_runtime *alsa_rt = sub->instance->runtime;
 
-	if (rt->panic)
-		return -EPIPE;
+	sub->busy = false;
 
-	mutex_lock(&rt->stream_mutex);
-	alsa_rt->hw = pcm_hw;
+	/* stopped or re-prepared while converting, the snapshot is stale */
+	if (!sub->active || pos->gen != sub->gen)
+		return false;
 
-	if (alsa_sub->stream == SNDRV_PCM_STREAM_PLAYBACK) {
-		sub = &rt->playback;
-	} else if (alsa_sub->stream == SNDRV_PCM_STREAM_CAPTURE) {
-		sub = &rt->capture;
-	}
+	sub->dma_off = xonedb4_frames_next(pos, frames);
+	sub->frames += frames;
+
+	return xonedb4_frames_period(&sub->period_off, frames, alsa_rt->period_size);
+}
 
-	rt->rate = ARRAY_SIZE(rates);
-	alsa_rt->hw.rates = rates_alsaid[rt->rate];
+/* snapshots every running substream of one direction, returns them as a mask */
+static unsigned int xonedb4_pcm_snapshot_all(struct pcm_substream *subs, struct xonedb4_position *pos)
+{
+	unsigned int active = 0;
+	unsigned long flags;
+	int i;
 
-	if (!sub) {
-		mutex_unlock(&rt->stream_mutex);
-		dev_err(&rt->chip->dev->dev, "%s: Invalid stream type\n", __func__);
-		return -EINVAL;
+	for (i = 0; i < PCM_N_DEVICES; i++) {
+		spin_lock_irqsave(&subs[i].lock, flags);
+		if (xonedb4_pcm_snapshot(&subs[i], &pos[i]))
+			active |= BIT(i);
+		spin_unlock_irqrestore(&subs[i].lock, flags);
 	}
 
-	sub->instance = alsa_sub;
-	sub->active = false;
-	mutex_unlock(&rt->stream_mutex);
-	return 0;
+	return active;
 }
 
-static int xonedb4_pcm_close(struct snd_pcm_substream *alsa_sub)
+/* commits what snapshot_all took, returns the substreams with an elapsed period */
+static unsigned int xonedb4_pcm_commit_all(struct pcm_substream *subs, const struct xonedb4_position *pos, unsigned int active, unsigned int frames)
 {
-	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
-	struct pcm_substream *sub = xonedb4_pcm_get_substream(alsa_sub);
+	unsigned int elapsed = 0;
 	unsigned long flags;
+	int i;
+
+	for (i = 0; i < PCM_N_DEVICES; i++) {
+		if (!(active & BIT(i)))
+			continue;
+
+		spin_lock_irqsave(&subs[i].lock, flags);
+		if (xonedb4_pcm_commit(&subs[i], &pos[i], frames))
+			elapsed |= BIT(i);
+		spin_unlock_irqrestore(&subs[i].lock, flags);
+	}
+
+	return elapsed;
+}
+
+static void xonedb4_pcm_periods_elapsed(struct pcm_substream *subs, unsigned int elapsed, struct xonedb4_stats_dir *stats)
+{
+	int i;
+
+	for (i = 0; i < PCM_N_DEVICES; i++) {
+		if (!(elapsed & BIT(i)) || READ_ONCE(subs[i].timed))
+			continue;
+
+		atomic64_inc(&stats->periods);
+		snd_pcm_period_elapsed(subs[i].instance);
+	}
+}
+
+/* fills out_urb->frames from every running playback substream, channels nobody plays stay silent */
+static void xonedb4_pcm_gather_all(struct pcm_runtime *rt, const struct xonedb4_position *pos, unsigned int active, struct pcm_urb *out_urb)
+{
+	u64 route = READ_ONCE(rt->route[SNDRV_PCM_STREAM_PLAYBACK]);
+	int i;
+
+	if (!(active & BIT(0)))
+		memset(out_urb->frames, 0, ALSA_PCM_OUT_PACKET_SIZE);
+
+	for (i = 0; i < PCM_N_DEVICES; i++) {
+		if (active & BIT(i))
+			xonedb4_frames_gather(&pos[i], out_urb->frames, XDB4_PCM_OUT_FRAMES_PER_PACKET, route);
+	}
+}
+
+/* raw_pcm: the ALSA frames already are device frames, returns false if nothing was copied */
+static bool xonedb4_pcm_raw_playback(struct pcm_runtime *rt, struct pcm_urb *out_urb)
+{
+	struct pcm_substream *sub = &rt->raw_playback;
+	struct xonedb4_position pos;
+	unsigned long flags;
+	bool elapsed;
+
+	spin_lock_irqsave(&sub->lock, flags);
+	if (!xonedb4_pcm_snapshot(sub, &pos)) {
+		spin_unlock_irqrestore(&sub->lock, flags);
+		return false;
+	}
+	spin_unlock_irqrestore(&sub->lock, flags);
+
+	xonedb4_frames_raw_out(&pos, out_urb->buffer, usb_pipebulk(out_urb->instance.pipe));
+
+	spin_lock_irqsave(&sub->lock, flags);
+	elapsed = xonedb4_pcm_commit(sub, &pos, XDB4_PCM_OUT_FRAMES_PER_PACKET);
+	spin_unlock_irqrestore(&sub->lock, flags);
+
+	if (elapsed && !READ_ONCE(sub->timed)) {
+		atomic64_inc(&rt->stats.dir[XDB4_STATS_PLAYBACK].periods);
+		snd_pcm_period_elapsed(sub->instance);
+	}
+
+	return true;
+}
+
+/* raw_pcm: IN packets are whole device frames */
+static void xonedb4_pcm_raw_capture(struct pcm_runtime *rt, struct pcm_urb *in_urb)
+{
+	struct pcm_substream *sub = &rt->raw_capture;
+	struct xonedb4_position pos;
+	unsigned long flags;
+	bool elapsed;
+
+	spin_lock_irqsave(&sub->lock, flags);
+	if (!xonedb4_pcm_snapshot(sub, &pos)) {
+		spin_unlock_irqrestore(&sub->lock, flags);
+		return;
+	}
+	spin_unlock_irqrestore(&sub->lock, flags);
+
+	xonedb4_frames_raw_in(&pos, in_urb->buffer);
+
+	spin_lock_irqsave(&sub->lock, flags);
+	elapsed = xonedb4_pcm_commit(sub, &pos, XDB4_PCM_IN_FRAMES_PER_PACKET);
+	spin_unlock_irqrestore(&sub->lock, flags);
+
+	if (elapsed && !READ_ONCE(sub->timed)) {
+		atomic64_inc(&rt->stats.dir[XDB4_STATS_CAPTURE].periods);
+		snd_pcm_period_elapsed(sub->instance);
+	}
+}
+
+/* hands the frames just encoded into out_urb to the loopback substream */
+static void xonedb4_pcm_loopback(struct pcm_runtime *rt, struct pcm_urb *out_urb, bool playing)
+{
+	struct pcm_substream *sub = &rt->loopback;
+	struct xonedb4_position pos;
+	unsigned long flags;
+	bool elapsed;
+
+	spin_lock_irqsave(&sub->lock, flags);
+	if (!xonedb4_pcm_snapshot(sub, &pos)) {
+		spin_unlock_irqrestore(&sub->lock, flags);
+		return;
+	}
+	spin_unlock_irqrestore(&sub->lock, flags);
+
+	/* the URB went out with silence */
+	if (!playing)
+		memset(out_urb->frames, 0, ALSA_PCM_OUT_PACKET_SIZE);
+
+	xonedb4_frames_scatter(&pos, out_urb->frames, XDB4_PCM_OUT_FRAMES_PER_PACKET, XDB4_ROUTE_IDENTITY);
+
+	spin_lock_irqsave(&sub->lock, flags);
+	elapsed = xonedb4_pcm_commit(sub, &pos, XDB4_PCM_OUT_FRAMES_PER_PACKET);
+	spin_unlock_irqrestore(&sub->lock, flags);
+
+	if (elapsed && !READ_ONCE(sub->timed)) {
+		atomic64_inc(&rt->stats.dir[XDB4_STATS_CAPTURE].periods);
+		snd_pcm_period_elapsed(sub->instance);
+	}
+}
+
+static int xonedb4_pcm_classify(int status)
+{
+	switch (status) {
+	case 0:
+		return URB_OK;
+	case -ENOENT:
+	case -ECONNRESET:
+	case -EPERM:
+		return URB_STOPPED;
+	case -ENODEV:
+	case -ESHUTDOWN:
+		return URB_FATAL;
+	default: /* -EPROTO, -EILSEQ, -EOVERFLOW, -EPIPE, -ETIME, ... */
+		return URB_RECOVER;
+	}
+}
+
+/* a completion or resubmission failed, the URB is not in flight anymore */
+static void xonedb4_pcm_urb_failed(struct pcm_runtime *rt, int status)
+{
+	switch (xonedb4_pcm_classify(status)) {
+	case URB_RECOVER:
+		dev_warn_ratelimited(&rt->chip->dev->dev, "%s: URB error %d, restarting\n", __func__, status);
+		schedule_work(&rt->recovery_work);
+		break;
+	case URB_FATAL:
+		dev_err(&rt->chip->dev->dev, "%s: URB error %d, device gone\n", __func__, status);
+		rt->panic = true;
+		break;
+	default:
+		break;
+	}
+}
+
+static void xonedb4_pcm_in_urb_handler(struct urb *usb_urb)
+{
+	struct pcm_urb *in_urb = usb_urb->context;
+	struct pcm_runtime *rt = in_urb->chip->pcm;
+	struct xonedb4_stats_dir *stats = &rt->stats.dir[XDB4_STATS_CAPTURE];
+	struct xonedb4_position pos[PCM_N_DEVICES];
+	ktime_t now;
+	unsigned int elapsed = 0;
+	unsigned int active;
+	u64 route;
+	int ret;
+	int i;
+
+	if (rt->panic || rt->stream_state == STREAM_STOPPING || !READ_ONCE(rt->capture_on))
+		return;
+
+	ret = usb_urb->status;
+	if (unlikely(ret)) {
+		xonedb4_stats_urb_error(stats, ret);
+		goto in_fail;
+	}
+
+	now = ktime_get();
+	WRITE_ONCE(rt->watchdog[XDB4_STATS_CAPTURE].last, ktime_to_ns(now));
+	xonedb4_stats_complete(stats, now);
+
+	active = xonedb4_pcm_snapshot_all(rt->capture, pos);
+
+	if (active) {
+		route = READ_ONCE(rt->route[SNDRV_PCM_STREAM_CAPTURE]);
+		xonedb4_frames_decode(in_urb->frames, in_urb->buffer);
+		for (i = 0; i < PCM_N_DEVICES; i++) {
+			if (active & BIT(i))
+				xonedb4_frames_scatter(&pos[i], in_urb->frames, XDB4_PCM_IN_FRAMES_PER_PACKET, route);
+		}
+		xonedb4_stats_convert(stats, now, ktime_get());
+
+		elapsed = xonedb4_pcm_commit_all(rt->capture, pos, active, XDB4_PCM_IN_FRAMES_PER_PACKET);
+	}
+
+	trace_xonedb4_pcm_in_urb(rt->chip->card->number, in_urb - rt->pcm_in_urbs, usb_urb->status, active ? pos[__ffs(active)].dma_off : 0, active ? XDB4_PCM_IN_FRAMES_PER_PACKET : 0);
+	xonedb4_pcm_record(rt, XDB4_REC_PCM_IN, in_urb, usb_urb->status, active ? &pos[__ffs(active)] : NULL, XDB4_PCM_IN_FRAMES_PER_PACKET);
+
+	xonedb4_pcm_periods_elapsed(rt->capture, elapsed, stats);
+	xonedb4_pcm_raw_capture(rt, in_urb);
+
+	ret = xonedb4_pcm_submit_urb(in_urb, &rt->in_anchor);
+
+	if (ret < 0) {
+		stats->submit_failures++;
+		goto in_fail;
+	}
+
+	return;
+
+in_fail:
+	trace_xonedb4_pcm_in_urb(rt->chip->card->number, in_urb - rt->pcm_in_urbs, ret, 0, 0);
+	xonedb4_pcm_record(rt, XDB4_REC_PCM_IN, in_urb, ret, NULL, 0);
+	xonedb4_pcm_urb_failed(rt, ret);
+}
+
+static void xonedb4_pcm_bulk_out_urb_handler(struct urb *usb_urb)
+{
+	struct pcm_urb *out_urb = usb_urb->context;
+	struct pcm_runtime *rt = out_urb->chip->pcm;
+	struct xonedb4_stats_dir *stats = &rt->stats.dir[XDB4_STATS_PLAYBACK];
+	struct xonedb4_position pos[PCM_N_DEVICES];
+	ktime_t now;
+	unsigned int elapsed = 0;
+	unsigned int active;
+	int ret;
+
+	if (rt->panic || rt->stream_state == STREAM_STOPPING)
+		return;
+
+	ret = usb_urb->status;
+	if (unlikely(ret)) {
+		xonedb4_stats_urb_error(stats, ret);
+		goto out_fail;
+	}
+
+	if (rt->idle) {
+		xonedb4_pcm_idle_complete(rt, out_urb);
+		return;
+	}
+
+	now = ktime_get();
+	WRITE_ONCE(rt->watchdog[XDB4_STATS_PLAYBACK].last, ktime_to_ns(now));
+	xonedb4_clock_update(&rt->clock, now);
+	xonedb4_stats_complete(stats, now);
+	xonedb4_pcm_timer_tick(rt);
+
+	active = xonedb4_pcm_snapshot_all(rt->playback, pos);
+
+	if (active) {
+		xonedb4_pcm_gather_all(rt, pos, active, out_urb);
+		xonedb4_frames_encode(out_urb->buffer, out_urb->frames, true);
+		xonedb4_stats_convert(stats, now, ktime_get());
+		out_urb->clean = false;
+
+		elapsed = xonedb4_pcm_commit_all(rt->playback, pos, active, XDB4_PCM_OUT_FRAMES_PER_PACKET);
+	} else if (xonedb4_pcm_raw_playback(rt, out_urb)) {
+		out_urb->clean = false;
+	} else if (!out_urb->clean) {
+		xonedb4_pcm_out_silence(rt, out_urb);
+	}
+
+	trace_xonedb4_pcm_out_urb(rt->chip->card->number, out_urb - rt->pcm_out_urbs, usb_urb->status, active ? pos[__ffs(active)].dma_off : 0, active ? XDB4_PCM_OUT_FRAMES_PER_PACKET : 0);
+
+	xonedb4_pcm_periods_elapsed(rt->playback, elapsed, stats);
+	xonedb4_pcm_loopback(rt, out_urb, active);
+
+	xonedb4_pcm_out_midi(out_urb);
+	xonedb4_pcm_record(rt, XDB4_REC_PCM_OUT, out_urb, usb_urb->status, active ? &pos[__ffs(active)] : NULL, XDB4_PCM_OUT_FRAMES_PER_PACKET);
+
+	ret = xonedb4_pcm_submit_urb(out_urb, &rt->out_anchor);
+
+	if (ret < 0) {
+		stats->submit_failures++;
+		goto out_fail;
+	}
+
+	return;
+
+out_fail:
+	trace_xonedb4_pcm_out_urb(rt->chip->card->number, out_urb - rt->pcm_out_urbs, ret, 0, 0);
+	xonedb4_pcm_record(rt, XDB4_REC_PCM_OUT, out_urb, ret, NULL, 0);
+	xonedb4_pcm_urb_failed(rt, ret);
+}
+
+static void xonedb4_pcm_int_out_urb_handler(struct urb *usb_urb)
+{
+	struct pcm_urb *out_urb = usb_urb->context;
+	struct pcm_runtime *rt = out_urb->chip->pcm;
+	struct xonedb4_stats_dir *stats = &rt->stats.dir[XDB4_STATS_PLAYBACK];
+	struct xonedb4_position pos[PCM_N_DEVICES];
+	ktime_t now;
+	unsigned int elapsed = 0;
+	unsigned int active;
+	int ret;
+
+	if (rt->panic || rt->stream_state == STREAM_STOPPING)
+		return;
+
+	ret = usb_urb->status;
+	if (unlikely(ret)) {
+		xonedb4_stats_urb_error(stats, ret);
+		goto out_fail;
+	}
+
+	if (rt->idle) {
+		xonedb4_pcm_idle_complete(rt, out_urb);
+		return;
+	}
+
+	now = ktime_get();
+	WRITE_ONCE(rt->watchdog[XDB4_STATS_PLAYBACK].last, ktime_to_ns(now));
+	xonedb4_clock_update(&rt->clock, now);
+	xonedb4_stats_complete(stats, now);
+	xonedb4_pcm_timer_tick(rt);
+
+	active = xonedb4_pcm_snapshot_all(rt->playback, pos);
+
+	if (active) {
+		xonedb4_pcm_gather_all(rt, pos, active, out_urb);
+		xonedb4_frames_encode(out_urb->buffer, out_urb->frames, false);
+		xonedb4_stats_convert(stats, now, ktime_get());
+		out_urb->clean = false;
+
+		elapsed = xonedb4_pcm_commit_all(rt->playback, pos, active, XDB4_PCM_OUT_FRAMES_PER_PACKET);
+	} else if (xonedb4_pcm_raw_playback(rt, out_urb)) {
+		out_urb->clean = false;
+	} else if (!out_urb->clean) {
+		xonedb4_pcm_out_silence(rt, out_urb);
+	}
+
+	trace_xonedb4_pcm_out_urb(rt->chip->card->number, out_urb - rt->pcm_out_urbs, usb_urb->status, active ? pos[__ffs(active)].dma_off : 0, active ? XDB4_PCM_OUT_FRAMES_PER_PACKET : 0);
+
+	xonedb4_pcm_periods_elapsed(rt->playback, elapsed, stats);
+	xonedb4_pcm_loopback(rt, out_urb, active);
+
+	xonedb4_pcm_out_midi(out_urb);
+	xonedb4_pcm_record(rt, XDB4_REC_PCM_OUT, out_urb, usb_urb->status, active ? &pos[__ffs(active)] : NULL, XDB4_PCM_OUT_FRAMES_PER_PACKET);
+
+	ret = xonedb4_pcm_submit_urb(out_urb, &rt->out_anchor);
+	
+	if (ret < 0) {
+		stats->submit_failures++;
+		goto out_fail;
+	}
+
+	return;
+
+out_fail:
+	trace_xonedb4_pcm_out_urb(rt->chip->card->number, out_urb - rt->pcm_out_urbs, ret, 0, 0);
+	xonedb4_pcm_record(rt, XDB4_REC_PCM_OUT, out_urb, ret, NULL, 0);
+	xonedb4_pcm_urb_failed(rt, ret);
+}
+
+/* call with stream_mutex locked */
+static bool xonedb4_pcm_any_open(const struct pcm_substream *subs)
+{
+	int i;
+
+	for (i = 0; i < PCM_N_DEVICES; i++) {
+		if (subs[i].instance)
+			return true;
+	}
+
+	return false;
+}
+
+/* call with stream_mutex locked, true if an open substream rules out sub */
+static bool xonedb4_pcm_conflicts(struct pcm_runtime *rt, struct pcm_substream *sub)
+{
+	bool playback = sub->stream == SNDRV_PCM_STREAM_PLAYBACK;
+	struct pcm_substream *subs = playback ? rt->playback : rt->capture;
+	struct pcm_substream *raw = playback ? &rt->raw_playback : &rt->raw_capture;
+	int i;
+
+	/* raw playback never has converted frames to loop back */
+	if (sub == &rt->loopback)
+		return rt->raw_playback.instance;
+	if (sub == &rt->raw_playback && rt->loopback.instance)
+		return true;
+
+	if (sub == raw)
+		return xonedb4_pcm_any_open(subs);
+	if (raw->instance)
+		return true;
+
+	/* the 8 channel device and the stereo pairs address the same channels */
+	for (i = 0; i < PCM_N_DEVICES; i++) {
+		if (subs[i].instance && (sub == &subs[0] || i == 0))
+			return true;
+	}
+
+	return false;
+}
+
+/* a stream that started after this substream was opened fixes the rate too */
+static int xonedb4_pcm_rule_rate(struct snd_pcm_hw_params *params, struct snd_pcm_hw_rule *rule)
+{
+	struct pcm_runtime *rt = rule->private;
+	struct snd_interval *rate = hw_param_interval(params, SNDRV_PCM_HW_PARAM_RATE);
+	struct snd_interval running = { .integer = 1 };
+
+	/* one load, close may stop the stream at any time */
+	running.min = READ_ONCE(rt->running_rate);
+	if (!running.min)
+		return 0;
+
+	running.max = running.min;
+	return snd_interval_refine(rate, &running);
+}
+
+/*
+ * Periods on packet boundaries get their interrupt from a single
+ * completion each instead of drifting across packets. This only pulls
+ * the bounds of the period size in to packet multiples when the range
+ * holds one, so a fixed size like 256 frames stays legal.
+ */
+static int xonedb4_pcm_rule_period_size(struct snd_pcm_hw_params *params, struct snd_pcm_hw_rule *rule)
+{
+	struct pcm_substream *sub = rule->private;
+	struct snd_interval *period = hw_param_interval(params, SNDRV_PCM_HW_PARAM_PERIOD_SIZE);
+	struct snd_interval packets = { .integer = 1 };
+
+	packets.min = roundup(period->min + period->openmin, sub->packet_frames);
+	packets.max = rounddown(period->max - period->openmax, sub->packet_frames);
+	if (packets.min > packets.max)
+		return 0;
+
+	return snd_interval_refine(period, &packets);
+}
+
+static int xonedb4_pcm_open(struct snd_pcm_substream *alsa_sub)
+{
+	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
+	struct pcm_substream *sub = xonedb4_pcm_get_substream(alsa_sub);
+	struct snd_pcm_runtime *alsa_rt = alsa_sub->runtime;
+	int ret;
+
+	if (rt->panic)
+		return -EPIPE;
+
+	if (!sub) {
+		dev_err(&rt->chip->dev->dev, "%s: Invalid stream type\n", __func__);
+		return -EINVAL;
+	}
+
+	mutex_lock(&rt->stream_mutex);
+	alsa_rt->hw = pcm_hw;
+
+	if (xonedb4_pcm_conflicts(rt, sub)) {
+		mutex_unlock(&rt->stream_mutex);
+		return -EBUSY;
+	}
+
+	alsa_rt->hw.formats = pcm_format_to_bits(sub->format);
+	alsa_rt->hw.channels_min = sub->channels;
+	alsa_rt->hw.channels_max = sub->channels;
+
+	/* all devices share the URBs, once they run the rate is fixed */
+	if (rt->stream_state != STREAM_DISABLED) {
+		alsa_rt->hw.rates = rates_alsaid[rt->rate];
+		alsa_rt->hw.rate_min = rates[rt->rate];
+		alsa_rt->hw.rate_max = rates[rt->rate];
+	}
+
+	/*
+	 * One packet is the shortest period. Packet multiples are preferred,
+	 * see xonedb4_pcm_rule_period_size, the buffer follows as a whole
+	 * number of periods.
+	 */
+	alsa_rt->hw.period_bytes_min = sub->packet_frames * sub->frame_bytes;
+	ret = snd_pcm_hw_rule_add(alsa_rt, 0, SNDRV_PCM_HW_PARAM_PERIOD_SIZE, xonedb4_pcm_rule_period_size, sub, SNDRV_PCM_HW_PARAM_PERIOD_SIZE, -1);
+	if (ret >= 0) {
+		ret = snd_pcm_hw_rule_add(alsa_rt, 0, SNDRV_PCM_HW_PARAM_RATE, xonedb4_pcm_rule_rate, rt, SNDRV_PCM_HW_PARAM_RATE, -1);
+	}
+	if (ret >= 0) {
+		ret = snd_pcm_hw_constraint_integer(alsa_rt, SNDRV_PCM_HW_PARAM_PERIODS);
+	}
+	if (ret < 0) {
+		mutex_unlock(&rt->stream_mutex);
+		dev_err(&rt->chip->dev->dev, "%s: Cannot set constraints\n", __func__);
+		return ret;
+	}
+
+	sub->instance = alsa_sub;
+	sub->active = false;
+	mutex_unlock(&rt->stream_mutex);
+	return 0;
+}
+
+static int xonedb4_pcm_close(struct snd_pcm_substream *alsa_sub)
+{
+	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
+	struct pcm_substream *sub = xonedb4_pcm_get_substream(alsa_sub);
+	unsigned long flags;
+
+	if (rt->panic)
+		return 0;
+
+	mutex_lock(&rt->stream_mutex);
+	if (sub) {
+		/* deactivate substream */
+		spin_lock_irqsave(&sub->lock, flags);
+		sub->instance = NULL;
+		sub->active = false;
+		spin_unlock_irqrestore(&sub->lock, flags);
+
+		if (sub != &rt->loopback && sub->stream == SNDRV_PCM_STREAM_CAPTURE &&
+		    !xonedb4_pcm_any_open(rt->capture) && !rt->raw_capture.instance) {
+			xonedb4_pcm_stop_capture(rt);
+		}
+
+		/* all substreams closed? if so, stop streaming */
+		if (!xonedb4_pcm_any_open(rt->playback) && !xonedb4_pcm_any_open(rt->capture) && !rt->loopback.instance &&
+		    !rt->raw_playback.instance && !rt->raw_capture.instance) {
+			xonedb4_pcm_stream_stop(rt);
+			rt->rate = ARRAY_SIZE(rates);
+			if (!READ_ONCE(rt->timer_on))
+				xonedb4_pcm_enter_idle(rt);
+		}
+	}
+	mutex_unlock(&rt->stream_mutex);
+	return 0;
+}
+
+static int xonedb4_pcm_prepare(struct snd_pcm_substream *alsa_sub)
+{
+	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
+	struct pcm_substream *sub = xonedb4_pcm_get_substream(alsa_sub);
+	struct snd_pcm_runtime *alsa_rt = alsa_sub->runtime;
+	int ret;
+
+	if (rt->panic)
+		return -EPIPE;
+	if (!sub)
+		return -ENODEV;
+
+	mutex_lock(&rt->stream_mutex);
+
+	if (alsa_rt->format != sub->format) {
+		mutex_unlock(&rt->stream_mutex);
+		return -EINVAL;
+	}
+
+	/* xruns the ALSA core found by itself, e.g. from the pointer */
+	if (alsa_rt->status->state == SNDRV_PCM_STATE_XRUN)
+		xonedb4_recorder_xrun(rt->chip->recorder, sub->stream);
+
+	spin_lock_irq(&sub->lock);
+	sub->dma_off = 0;
+	sub->period_off = 0;
+	sub->frames = 0;
+	sub->gen++;
+	sub->timed = READ_ONCE(timer_periods);
+	spin_unlock_irq(&sub->lock);
+
+	if (rt->stream_state == STREAM_DISABLED) {
+		for (rt->rate = 0; rt->rate < ARRAY_SIZE(rates); rt->rate++)
+			if (alsa_rt->rate == rates[rt->rate])
+				break;
+		if (rt->rate == ARRAY_SIZE(rates)) {
+			mutex_unlock(&rt->stream_mutex);
+			dev_err(&rt->chip->dev->dev, "%s: Invalid samplerate %d\n", __func__, alsa_rt->rate);
+			return -EINVAL;
+		}
+
+		dev_dbg(&rt->chip->dev->dev, "%s: Samplerate set to %d\n", __func__, alsa_rt->rate);
+
+		ret = xonedb4_pcm_leave_idle(rt);
+		if (ret) {
+			mutex_unlock(&rt->stream_mutex);
+			dev_err(&rt->chip->dev->dev, "%s: Cannot leave idle mode!\n", __func__);
+			return ret;
+		}
+
+		ret = xonedb4_pcm_set_rate(rt);
+		if (ret) {
+			mutex_unlock(&rt->stream_mutex);
+			return ret;
+		}
+
+		ret = xonedb4_pcm_stream_start(rt);
+		if (ret) {
+			mutex_unlock(&rt->stream_mutex);
+			dev_err(&rt->chip->dev->dev, "Could not start pcm stream!\n");
+			return ret;
+		}
+	} else if (alsa_rt->rate != rates[rt->rate]) {
+		/* hw_params ran before the stream started at another rate */
+		mutex_unlock(&rt->stream_mutex);
+		dev_err(&rt->chip->dev->dev, "%s: Stream runs at %d, not %d\n", __func__, rates[rt->rate], alsa_rt->rate);
+		return -EBUSY;
+	}
+
+	if (sub != &rt->loopback && sub->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		ret = xonedb4_pcm_start_capture(rt);
+		if (ret) {
+			mutex_unlock(&rt->stream_mutex);
+			return ret;
+		}
+	}
+	mutex_unlock(&rt->stream_mutex);
+	return 0;
+}
+
+/* duration of frames at the measured device rate, nominal until the clock runs */
+static u64 xonedb4_pcm_frames_to_ns(struct pcm_runtime *rt, struct snd_pcm_runtime *alsa_rt, unsigned int frames)
+{
+	u64 ns = xonedb4_clock_frames_to_ns(&rt->clock, frames);
+
+	return ns ? ns : div_u64((u64) frames * NSEC_PER_SEC, alsa_rt->rate);
+}
+
+/*
+ * timer_periods: fires at the period boundary predicted from the device clock
+ * estimate. Positions still move with the URB completions, so if the packet
+ * crossing the boundary hasn't completed yet the timer looks again a fraction
+ * of a packet later and takes that moment as the phase for the next periods.
+ */
+static enum hrtimer_restart xonedb4_pcm_period_timer(struct hrtimer *timer)
+{
+	struct pcm_substream *sub = container_of(timer, struct pcm_substream, period_timer);
+	struct pcm_runtime *rt = sub->rt;
+	struct snd_pcm_substream *alsa_sub;
+	struct snd_pcm_runtime *alsa_rt;
+	unsigned long flags;
+	bool elapsed;
+
+	spin_lock_irqsave(&sub->lock, flags);
+	if (rt->panic || !sub->active || !sub->instance) {
+		spin_unlock_irqrestore(&sub->lock, flags);
+		return HRTIMER_NORESTART;
+	}
+	alsa_sub = sub->instance;
+	alsa_rt = alsa_sub->runtime;
+	elapsed = sub->frames >= sub->period_target;
+	if (elapsed)
+		sub->period_target += alsa_rt->period_size;
+	spin_unlock_irqrestore(&sub->lock, flags);
+
+	if (!elapsed) {
+		sub->period_late = true;
+		hrtimer_forward_now(timer, ns_to_ktime(xonedb4_pcm_frames_to_ns(rt, alsa_rt, sub->packet_frames) / XDB4_PERIOD_RETRY_DIV));
+		return HRTIMER_RESTART;
+	}
+
+	if (sub->period_late)
+		sub->period_next = hrtimer_cb_get_time(timer);
+	sub->period_next = ktime_add_ns(sub->period_next, xonedb4_pcm_frames_to_ns(rt, alsa_rt, alsa_rt->period_size));
+	sub->period_late = false;
+	hrtimer_set_expires(timer, sub->period_next);
+
+	atomic64_inc(&rt->stats.dir[sub->stream == SNDRV_PCM_STREAM_PLAYBACK ? XDB4_STATS_PLAYBACK : XDB4_STATS_CAPTURE].periods);
+	snd_pcm_period_elapsed(alsa_sub);
+
+	return HRTIMER_RESTART;
+}
+
+/* call with substream locked */
+static void xonedb4_pcm_start_period_timer(struct pcm_substream *sub)
+{
+	struct snd_pcm_runtime *alsa_rt = sub->instance->runtime;
+
+	sub->period_target = sub->frames - sub->period_off + alsa_rt->period_size;
+	sub->period_next = ktime_add_ns(ktime_get(), xonedb4_pcm_frames_to_ns(sub->rt, alsa_rt, alsa_rt->period_size - sub->period_off));
+	sub->period_late = false;
+	hrtimer_start(&sub->period_timer, sub->period_next, HRTIMER_MODE_ABS);
+}
+
+static int xonedb4_pcm_trigger(struct snd_pcm_substream *alsa_sub, int cmd)
+{
+	struct pcm_substream *sub = xonedb4_pcm_get_substream(alsa_sub);
+	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
+
+	trace_xonedb4_pcm_trigger(rt->chip->card->number, alsa_sub->stream, cmd);
+
+	if (rt->panic)
+		return -EPIPE;
+	if (!sub)
+		return -ENODEV;
+
+	switch (cmd) {
+	case SNDRV_PCM_TRIGGER_START:
+	case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
+	case SNDRV_PCM_TRIGGER_RESUME:
+		spin_lock_irq(&sub->lock);
+		sub->active = true;
+		if (sub->timed)
+			xonedb4_pcm_start_period_timer(sub);
+		spin_unlock_irq(&sub->lock);
+		return 0;
+
+	case SNDRV_PCM_TRIGGER_STOP:
+	case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
+	case SNDRV_PCM_TRIGGER_SUSPEND:
+		spin_lock_irq(&sub->lock);
+		sub->active = false;
+		spin_unlock_irq(&sub->lock);
+		/* can't wait here, a running timer sees !active and stops itself */
+		hrtimer_try_to_cancel(&sub->period_timer);
+		return 0;
+
+	default:
+		return -EINVAL;
+	}
+}
+
+/* the conversion runs outside the lock, let it finish before the buffer goes away */
+static int xonedb4_pcm_sync_stop(struct snd_pcm_substream *alsa_sub)
+{
+	struct pcm_substream *sub = xonedb4_pcm_get_substream(alsa_sub);
+
+	if (!sub)
+		return 0;
+
+	hrtimer_cancel(&sub->period_timer);
+
+	while (READ_ONCE(sub->busy))
+		usleep_range(20, 50);
+
+	return 0;
+}
+
+static snd_pcm_uframes_t xonedb4_pcm_pointer(struct snd_pcm_substream *alsa_sub)
+{
+	struct pcm_substream *sub = xonedb4_pcm_get_substream(alsa_sub);
+	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
+	unsigned long flags;
+	snd_pcm_uframes_t dma_offset;
+
+	if (rt->panic || !sub) {
+		dev_err(&rt->chip->dev->dev, "%s: Xone XRUN!\n", __func__);
+		atomic64_inc(&rt->stats.dir[alsa_sub->stream == SNDRV_PCM_STREAM_PLAYBACK ? XDB4_STATS_PLAYBACK : XDB4_STATS_CAPTURE].xruns);
+		return SNDRV_PCM_POS_XRUN;
+	}
+
+	spin_lock_irqsave(&sub->lock, flags);
+	dma_offset = sub->dma_off;
+	spin_unlock_irqrestore(&sub->lock, flags);
+
+	trace_xonedb4_pcm_pointer(rt->chip->card->number, alsa_sub->stream, dma_offset);
+
+	return bytes_to_frames(alsa_sub->runtime, dma_offset);
+}
+
+void xonedb4_pcm_abort(struct xonedb4_chip *chip)
+{
+	struct pcm_runtime *rt = chip->pcm;
+	unsigned long flags;
+	int i;
+
+	if (rt) {
+		rt->panic = true;
+
+		cancel_work_sync(&rt->recovery_work);
+		cancel_work_sync(&rt->timer_work);
+		hrtimer_cancel(&rt->idle_timer);
+		for (i = 0; i < PCM_N_DEVICES; i++) {
+			hrtimer_cancel(&rt->playback[i].period_timer);
+			hrtimer_cancel(&rt->capture[i].period_timer);
+		}
+		hrtimer_cancel(&rt->loopback.period_timer);
+		hrtimer_cancel(&rt->raw_playback.period_timer);
+		hrtimer_cancel(&rt->raw_capture.period_timer);
+		spin_lock_irqsave(&rt->idle_lock, flags);
+		rt->idle = false;
+		spin_unlock_irqrestore(&rt->idle_lock, flags);
+		xonedb4_pcm_stream_stop(rt);
+		xonedb4_pcm_poison_urbs(rt);
+	}
+}
+
+/* kills the URBs but keeps stream state and ALSA positions, e.g. around a USB reset */
+void xonedb4_pcm_stop_urbs(struct xonedb4_chip *chip)
+{
+	struct pcm_runtime *rt = chip->pcm;
+	unsigned long flags;
+
+	if (!rt)
+		return;
+
+	cancel_work_sync(&rt->recovery_work);
+
+	mutex_lock(&rt->stream_mutex);
+	hrtimer_cancel(&rt->idle_timer);
+	/* a busy idle URB blocks further idle submissions until xonedb4_pcm_start_urbs */
+	spin_lock_irqsave(&rt->idle_lock, flags);
+	rt->idle_busy = true;
+	spin_unlock_irqrestore(&rt->idle_lock, flags);
+	xonedb4_pcm_halt_urbs(rt);
+	mutex_unlock(&rt->stream_mutex);
+}
+
+/* call with stream_mutex locked, resubmits halted URBs in idle or streaming mode */
+static int xonedb4_pcm_restart_urbs(struct pcm_runtime *rt)
+{
+	unsigned long flags;
+
+	xonedb4_pcm_reset_timing(rt);
+
+	if (!rt->idle)
+		return xonedb4_pcm_submit_urbs(rt);
+
+	spin_lock_irqsave(&rt->idle_lock, flags);
+	rt->idle_busy = false;
+	xonedb4_pcm_idle_submit(rt);
+	spin_unlock_irqrestore(&rt->idle_lock, flags);
+	hrtimer_start(&rt->idle_timer, xonedb4_pcm_keepalive_interval(), HRTIMER_MODE_REL);
+
+	return 0;
+}
+
+/* resubmits the URBs after xonedb4_pcm_stop_urbs, running substreams carry on where they were */
+int xonedb4_pcm_start_urbs(struct xonedb4_chip *chip)
+{
+	struct pcm_runtime *rt = chip->pcm;
+	int ret;
+
+	if (!rt)
+		return 0;
+
+	mutex_lock(&rt->stream_mutex);
+	rt->panic = false;
+	ret = xonedb4_pcm_restart_urbs(rt);
+	mutex_unlock(&rt->stream_mutex);
+
+	if (ret < 0) {
+		dev_err(&chip->dev->dev, "%s: Cannot restart PCM URBs!\n", __func__);
+		rt->panic = true;
+	}
+
+	return ret;
+}
+
+/* running substreams go to SUSPENDED and continue through TRIGGER_RESUME */
+void xonedb4_pcm_suspend(struct xonedb4_chip *chip)
+{
+	struct pcm_runtime *rt = chip->pcm;
+	int i;
+
+	if (!rt)
+		return;
+
+	for (i = 0; i < PCM_N_INSTANCES; i++)
+		snd_pcm_suspend_all(rt->instances[i]);
+	xonedb4_pcm_stop_urbs(chip);
+}
+
+/* under stream_mutex, so close cannot clear sub->instance under us */
+static void xonedb4_pcm_report_xrun(struct pcm_runtime *rt, struct pcm_substream *sub, struct xonedb4_stats_dir *stats)
+{
+	if (!sub->instance || !READ_ONCE(sub->active))
+		return;
+
+	atomic64_inc(&stats->xruns);
+	xonedb4_recorder_xrun(rt->chip->recorder, sub->stream);
+	snd_pcm_stop_xrun(sub->instance);
+}
+
+static void xonedb4_pcm_report_xruns(struct pcm_runtime *rt)
+{
+	int i;
+
+	for (i = 0; i < PCM_N_DEVICES; i++) {
+		xonedb4_pcm_report_xrun(rt, &rt->playback[i], &rt->stats.dir[XDB4_STATS_PLAYBACK]);
+		xonedb4_pcm_report_xrun(rt, &rt->capture[i], &rt->stats.dir[XDB4_STATS_CAPTURE]);
+	}
+	xonedb4_pcm_report_xrun(rt, &rt->loopback, &rt->stats.dir[XDB4_STATS_CAPTURE]);
+	xonedb4_pcm_report_xrun(rt, &rt->raw_playback, &rt->stats.dir[XDB4_STATS_PLAYBACK]);
+	xonedb4_pcm_report_xrun(rt, &rt->raw_capture, &rt->stats.dir[XDB4_STATS_CAPTURE]);
+}
+
+/* running substreams see an xrun and restart from prepare with fresh positions */
+static void xonedb4_pcm_recovery_work(struct work_struct *work)
+{
+	struct pcm_runtime *rt = container_of(work, struct pcm_runtime, recovery_work);
+	struct xonedb4_chip *chip = rt->chip;
+	int ret;
+	int i;
+
+	mutex_lock(&rt->stream_mutex);
+	if (rt->panic) {
+		mutex_unlock(&rt->stream_mutex);
+		return;
+	}
+
+	if (time_after(jiffies, rt->recovery_start + msecs_to_jiffies(XDB4_RECOVERY_WINDOW_MS))) {
+		rt->recovery_start = jiffies;
+		rt->recoveries = 0;
+	}
+	if (++rt->recoveries > XDB4_RECOVERY_BURST) {
+		dev_err(&chip->dev->dev, "%s: Too many URB errors, giving up\n", __func__);
+		rt->panic = true;
+	}
 
-	if (rt->panic)
-		return 0;
+	hrtimer_cancel(&rt->idle_timer);
+	xonedb4_pcm_halt_urbs(rt);
+	usb_clear_halt(chip->dev, rt->pcm_out_urbs[0].instance.pipe);
+	usb_clear_halt(chip->dev, rt->pcm_in_urbs[0].instance.pipe);
 
-	mutex_lock(&rt->stream_mutex);
-	if (sub) {
-		/* deactivate substream */
-		spin_lock_irqsave(&sub->lock, flags);
-		sub->instance = NULL;
-		sub->active = false;
-		spin_unlock_irqrestore(&sub->lock, flags);
+	xonedb4_pcm_report_xruns(rt);
 
-		/* all substreams closed? if so, stop streaming */
-		if (!rt->playback.instance && !rt->capture.instance) {
-			xonedb4_pcm_stream_stop(rt);
-			rt->rate = ARRAY_SIZE(rates);
+	if (!rt->panic) {
+		ret = xonedb4_pcm_restart_urbs(rt);
+		if (ret < 0) {
+			dev_err(&chip->dev->dev, "%s: Cannot restart PCM URBs!\n", __func__);
+			rt->panic = true;
+		} else {
+			dev_notice(&chip->dev->dev, "%s: PCM restarted after URB error (%u in this window)\n", __func__, rt->recoveries);
 		}
 	}
 	mutex_unlock(&rt->stream_mutex);
-	return 0;
 }
 
-static int xonedb4_pcm_prepare(struct snd_pcm_substream *alsa_sub)
+/* the URBs of one direction went quiet without an error, recovery_work gives clients their xrun */
+static enum hrtimer_restart xonedb4_pcm_watchdog(struct hrtimer *timer)
 {
-	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
-	struct pcm_substream *sub = xonedb4_pcm_get_substream(alsa_sub);
-	struct snd_pcm_runtime *alsa_rt = alsa_sub->runtime;
-	int ret;
+	struct pcm_watchdog *wd = container_of(timer, struct pcm_watchdog, timer);
+	struct pcm_runtime *rt = wd->rt;
+	u64 last = READ_ONCE(wd->last);
+	u64 now = ktime_get_ns();
 
-	if (rt->panic)
-		return -EPIPE;
-	if (!sub)
-		return -ENODEV;
+	if (rt->panic || rt->stream_state == STREAM_STOPPING)
+		return HRTIMER_NORESTART;
 
-	mutex_lock(&rt->stream_mutex);
+	/* idle OUT URBs only run every keepalive period */
+	if (wd->dir == XDB4_STATS_PLAYBACK ? READ_ONCE(rt->idle) : !READ_ONCE(rt->capture_on))
+		return HRTIMER_NORESTART;
 
-	if (alsa_rt->format != SNDRV_PCM_FORMAT_S24_3LE) {
-		return -EINVAL;
+	if (now - last < wd->timeout) {
+		hrtimer_set_expires(timer, ns_to_ktime(last + wd->timeout));
+		return HRTIMER_RESTART;
 	}
 
-	sub->dma_off = 0;
-	sub->period_off = 0;
-
-	if (rt->stream_state == STREAM_DISABLED) {
-		for (rt->rate = 0; rt->rate < ARRAY_SIZE(rates); rt->rate++)
-			if (alsa_rt->rate == rates[rt->rate])
-				break;
-		if (rt->rate == ARRAY_SIZE(rates)) {
-			mutex_unlock(&rt->stream_mutex);
-			dev_err(&rt->chip->dev->dev, "%s: Invalid samplerate %d\n", __func__, alsa_rt->rate);
-			return -EINVAL;
-		}
+	dev_warn_ratelimited(&rt->chip->dev->dev, "%s: No PCM %s completion for %llu us, restarting\n", __func__,
+			     wd->dir == XDB4_STATS_PLAYBACK ? "OUT" : "IN", div_u64(now - last, NSEC_PER_USEC));
+	atomic64_inc(&rt->stats.dir[wd->dir].stalls);
+	schedule_work(&rt->recovery_work);
 
-		dev_dbg(&rt->chip->dev->dev, "%s: Samplerate set to %d\n", __func__, alsa_rt->rate);
+	return HRTIMER_NORESTART;
+}
 
-		ret = xonedb4_pcm_set_rate(rt);
-		if (ret) {
-			mutex_unlock(&rt->stream_mutex);
-			return ret;
-		}
+static int xonedb4_pcm_timer_start(struct snd_timer *timer)
+{
+	struct pcm_runtime *rt = snd_timer_chip(timer);
 
-		ret = xonedb4_pcm_stream_start(rt);
-		if (ret) {
-			mutex_unlock(&rt->stream_mutex);
-			dev_err(&rt->chip->dev->dev, "Could not start pcm stream!\n");
-			return ret;
-		}
-	}
-	mutex_unlock(&rt->stream_mutex);
+	rt->timer_sticks = max(timer->sticks, 1UL);
+	rt->timer_count = 0;
+	WRITE_ONCE(rt->timer_on, true);
+	schedule_work(&rt->timer_work);
 	return 0;
 }
 
-static int xonedb4_pcm_trigger(struct snd_pcm_substream *alsa_sub, int cmd)
+static int xonedb4_pcm_timer_stop(struct snd_timer *timer)
 {
-	struct pcm_substream *sub = xonedb4_pcm_get_substream(alsa_sub);
-	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
-
-	if (rt->panic)
-		return -EPIPE;
-	if (!sub)
-		return -ENODEV;
+	struct pcm_runtime *rt = snd_timer_chip(timer);
 
-	switch (cmd) {
-	case SNDRV_PCM_TRIGGER_START:
-	case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
-		spin_lock_irq(&sub->lock);
-		sub->active = true;
-		spin_unlock_irq(&sub->lock);
-		return 0;
+	WRITE_ONCE(rt->timer_on, false);
+	schedule_work(&rt->timer_work);
+	return 0;
+}
 
-	case SNDRV_PCM_TRIGGER_STOP:
-	case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
-		spin_lock_irq(&sub->lock);
-		sub->active = false;
-		spin_unlock_irq(&sub->lock);
-		return 0;
+/* one tick per OUT packet */
+static unsigned long xonedb4_pcm_timer_resolution(struct snd_timer *timer)
+{
+	struct pcm_runtime *rt = snd_timer_chip(timer);
+	u64 ns = xonedb4_clock_frames_to_ns(&rt->clock, XDB4_PCM_OUT_FRAMES_PER_PACKET);
 
-	default:
-		return -EINVAL;
-	}
+	return ns ? ns : div_u64((u64) XDB4_PCM_OUT_FRAMES_PER_PACKET * NSEC_PER_SEC, rates[rt->chip->devicerate]);
 }
 
-static snd_pcm_uframes_t xonedb4_pcm_pointer(struct snd_pcm_substream *alsa_sub)
+/* the timer callbacks run atomic, the URBs leave and enter idle from here */
+static void xonedb4_pcm_timer_work(struct work_struct *work)
 {
-	struct pcm_substream *sub = xonedb4_pcm_get_substream(alsa_sub);
-	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
-	unsigned long flags;
-	snd_pcm_uframes_t dma_offset;
+	struct pcm_runtime *rt = container_of(work, struct pcm_runtime, timer_work);
 
-	if (rt->panic || !sub) {
-		dev_err(&rt->chip->dev->dev, "%s: Xone XRUN!\n", __func__);
-		return SNDRV_PCM_POS_XRUN;
+	mutex_lock(&rt->stream_mutex);
+	if (rt->panic) {
+		mutex_unlock(&rt->stream_mutex);
+		return;
 	}
 
-	spin_lock_irqsave(&sub->lock, flags);
-	dma_offset = sub->dma_off;
-	spin_unlock_irqrestore(&sub->lock, flags);
+	if (READ_ONCE(rt->timer_on)) {
+		if (xonedb4_pcm_leave_idle(rt))
+			dev_err(&rt->chip->dev->dev, "%s: Cannot start the URBs for the timer!\n", __func__);
+	} else if (rt->stream_state == STREAM_DISABLED) {
+		xonedb4_pcm_enter_idle(rt);
+	}
+	mutex_unlock(&rt->stream_mutex);
+}
 
-	return bytes_to_frames(alsa_sub->runtime, dma_offset);
+static const struct snd_timer_hardware timer_hw = {
+	.flags = SNDRV_TIMER_HW_AUTO,
+	.ticks = XDB4_TIMER_MAX_TICKS,
+	.start = xonedb4_pcm_timer_start,
+	.stop = xonedb4_pcm_timer_stop,
+	.c_resolution = xonedb4_pcm_timer_resolution
+};
+
+/* value n is the source of channel n, both counted from 1 */
+static int xonedb4_pcm_route_info(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = PCM_N_PLAYBACK_CHANNELS;
+	uinfo->value.integer.min = 1;
+	uinfo->value.integer.max = PCM_N_PLAYBACK_CHANNELS;
+	return 0;
 }
 
-void xonedb4_pcm_abort(struct xonedb4_chip *chip)
+static int xonedb4_pcm_route_get(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
 {
-	struct pcm_runtime *rt = chip->pcm;
+	struct pcm_runtime *rt = snd_kcontrol_chip(kcontrol);
+	u64 route = READ_ONCE(rt->route[kcontrol->private_value]);
+	int i;
 
-	if (rt) {
-		rt->panic = true;
+	for (i = 0; i < PCM_N_PLAYBACK_CHANNELS; i++)
+		ucontrol->value.integer.value[i] = xonedb4_frames_route_source(route, i) + 1;
+	return 0;
+}
 
-		xonedb4_pcm_stream_stop(rt);
-		xonedb4_pcm_poison_urbs(rt);
+static int xonedb4_pcm_route_put(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+	struct pcm_runtime *rt = snd_kcontrol_chip(kcontrol);
+	u64 route = 0;
+	long src;
+	int i;
+
+	for (i = 0; i < PCM_N_PLAYBACK_CHANNELS; i++) {
+		src = ucontrol->value.integer.value[i];
+		if (src < 1 || src > PCM_N_PLAYBACK_CHANNELS)
+			return -EINVAL;
+		route |= (u64) (src - 1) << (i * 8);
 	}
+
+	if (route == READ_ONCE(rt->route[kcontrol->private_value]))
+		return 0;
+
+	WRITE_ONCE(rt->route[kcontrol->private_value], route);
+	return 1;
 }
 
+static const struct snd_kcontrol_new route_controls[] = {
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "Playback Channel Route",
+		.info = xonedb4_pcm_route_info,
+		.get = xonedb4_pcm_route_get,
+		.put = xonedb4_pcm_route_put,
+		.private_value = SNDRV_PCM_STREAM_PLAYBACK
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "Capture Channel Route",
+		.info = xonedb4_pcm_route_info,
+		.get = xonedb4_pcm_route_get,
+		.put = xonedb4_pcm_route_put,
+		.private_value = SNDRV_PCM_STREAM_CAPTURE
+	}
+};
+
 static const struct snd_pcm_ops pcm_ops = {
 	.open = xonedb4_pcm_open,
 	.close = xonedb4_pcm_close,
 	.prepare = xonedb4_pcm_prepare,
 	.trigger = xonedb4_pcm_trigger,
+	.sync_stop = xonedb4_pcm_sync_stop,
 	.pointer = xonedb4_pcm_pointer,
 };
 
+/* four 512 byte segments: 480 audio bytes, MIDI byte, 0xFF, 30 bytes padding */
+static void xonedb4_pcm_build_bulk_silence(uint8_t *buffer)
+{
+	int i;
+
+	memset(buffer, 0, XDB4_PCM_BULK_OUT_PACKET_SIZE);
+	for (i = 0; i < 4; i++) {
+		buffer[(i * 512) + 480] = 0xFD;
+		buffer[(i * 512) + 481] = 0xFF;
+	}
+}
+
+/* audio interleaved with four pairs of MIDI bytes */
+static void xonedb4_pcm_build_int_silence(uint8_t *buffer)
+{
+	memset(buffer, 0, XDB4_PCM_INT_OUT_PACKET_SIZE);
+	memset(buffer + 432, 0xFD, 2);
+	memset(buffer + 914, 0xFD, 2);
+	memset(buffer + 1396, 0xFD, 2);
+	memset(buffer + 1878, 0xFD, 2);
+}
+
 static int xonedb4_pcm_init_bulk_out_urbs(struct pcm_urb *urb, struct xonedb4_chip *chip, unsigned int ep, void (*handler)(struct urb *))
 {
 	urb->chip = chip;
@@ -765,22 +1788,12 @@ static int xonedb4_pcm_init_bulk_out_urbs(struct pcm_urb *urb, struct xonedb4_ch
 		return -ENOMEM;
 	}
 
-	memset(urb->buffer + 0, 0, 480);
-	xonedb4_get_midi_output(urb->buffer + 480, 1);
-	memset(urb->buffer + 481, 0xff, 1);
-	memset(urb->buffer + 482, 0, 30);
-	memset(urb->buffer + 512, 0, 480);
-	xonedb4_get_midi_output(urb->buffer + 992, 1);
-	memset(urb->buffer + 993, 0xff, 1);
-	memset(urb->buffer + 994, 0, 30);
-	memset(urb->buffer + 1024, 0, 480);
-	xonedb4_get_midi_output(urb->buffer + 1504, 1);
-	memset(urb->buffer + 1505, 0xff, 1);
-	memset(urb->buffer + 1506, 0, 30);
-	memset(urb->buffer + 1536, 0, 480);
-	xonedb4_get_midi_output(urb->buffer + 2016, 1);
-	memset(urb->buffer + 2017, 0xff, 1);
-	memset(urb->buffer + 2018, 0, 30);
+	urb->frames = kzalloc(ALSA_PCM_OUT_PACKET_SIZE, GFP_KERNEL);
+	if (!urb->frames) {
+		return -ENOMEM;
+	}
+
+	xonedb4_pcm_out_silence(chip->pcm, urb);
 
 	usb_fill_bulk_urb(&urb->instance, chip->dev, usb_sndbulkpipe(chip->dev, ep), (void *)urb->buffer, XDB4_PCM_BULK_OUT_PACKET_SIZE, handler, urb);
 	if (usb_urb_ep_type_check(&urb->instance)) {
@@ -788,8 +1801,6 @@ static int xonedb4_pcm_init_bulk_out_urbs(struct pcm_urb *urb, struct xonedb4_ch
 		return -EINVAL;
 	}
 
-	init_usb_anchor(&urb->submitted);
-
 	return 0;
 }
 
@@ -803,15 +1814,12 @@ static int xonedb4_pcm_init_int_out_urbs(struct pcm_urb *urb, struct xonedb4_chi
 		return -ENOMEM;
 	}
 
-	memset(urb->buffer + 0, 0, 432);
-	xonedb4_get_midi_output(urb->buffer + 432, 2);
-	memset(urb->buffer + 434, 0, 480);
-	xonedb4_get_midi_output(urb->buffer + 914, 2);
-	memset(urb->buffer + 916, 0, 480);
-	xonedb4_get_midi_output(urb->buffer + 1396, 2);
-	memset(urb->buffer + 1398, 0, 480);
-	xonedb4_get_midi_output(urb->buffer + 1878, 2);
-	memset(urb->buffer + 1880, 0, 48);
+	urb->frames = kzalloc(ALSA_PCM_OUT_PACKET_SIZE, GFP_KERNEL);
+	if (!urb->frames) {
+		return -ENOMEM;
+	}
+
+	xonedb4_pcm_out_silence(chip->pcm, urb);
 
 	usb_fill_int_urb(&urb->instance, chip->dev, usb_sndintpipe(chip->dev, ep), (void *)urb->buffer, XDB4_PCM_INT_OUT_PACKET_SIZE, handler, urb, chip->dev->ep_out[PCM_OUT_EP]->desc.bInterval);
 	if (usb_urb_ep_type_check(&urb->instance)) {
@@ -819,8 +1827,6 @@ static int xonedb4_pcm_init_int_out_urbs(struct pcm_urb *urb, struct xonedb4_chi
 		return -EINVAL;
 	}
 
-	init_usb_anchor(&urb->submitted);
-
 	return 0;
 }
 
@@ -834,14 +1840,17 @@ static int xonedb4_pcm_init_bulk_in_urbs(struct pcm_urb *urb, struct xonedb4_chi
 		return -ENOMEM;
 	}
 
+	urb->frames = kzalloc(ALSA_PCM_IN_PACKET_SIZE, GFP_KERNEL);
+	if (!urb->frames) {
+		return -ENOMEM;
+	}
+
 	usb_fill_bulk_urb(&urb->instance, chip->dev, usb_rcvbulkpipe(chip->dev, ep), (void *)urb->buffer, XDB4_PCM_IN_PACKET_SIZE, handler, urb);
 	if (usb_urb_ep_type_check(&urb->instance)) {
 		dev_err(&chip->dev->dev, "%s: Sanity check failed!\n", __func__);
 		return -EINVAL;
 	}
 
-	init_usb_anchor(&urb->submitted);
-
 	return 0;
 }
 
@@ -855,17 +1864,33 @@ static int xonedb4_pcm_init_int_in_urbs(struct pcm_urb *urb, struct xonedb4_chip
 		return -ENOMEM;
 	}
 
+	urb->frames = kzalloc(ALSA_PCM_IN_PACKET_SIZE, GFP_KERNEL);
+	if (!urb->frames) {
+		return -ENOMEM;
+	}
+
 	usb_fill_int_urb(&urb->instance, chip->dev, usb_rcvintpipe(chip->dev, ep), (void *)urb->buffer, XDB4_PCM_IN_PACKET_SIZE, handler, urb, chip->dev->ep_in[PCM_IN_EP]->desc.bInterval);
 	if (usb_urb_ep_type_check(&urb->instance)) {
 		dev_err(&chip->dev->dev, "%s: Sanity check failed!\n", __func__);
 		return -EINVAL;
 	}
 
-	init_usb_anchor(&urb->submitted);
-
 	return 0;
 }
 
+static void xonedb4_pcm_free_urbs(struct pcm_runtime *rt)
+{
+	int i;
+
+	for (i = 0; i < PCM_N_URBS; i++) {
+		kfree(rt->pcm_out_urbs[i].buffer);
+		kfree(rt->pcm_out_urbs[i].frames);
+		kfree(rt->pcm_in_urbs[i].buffer);
+		kfree(rt->pcm_in_urbs[i].frames);
+	}
+	kfree(rt->out_silence);
+}
+
 int xonedb4_pcm_init_urbs(struct xonedb4_chip *chip)
 {
 	uint8_t i;
@@ -874,6 +1899,10 @@ int xonedb4_pcm_init_urbs(struct xonedb4_chip *chip)
 	struct pcm_runtime *rt = chip->pcm;
 	rt->chip = chip;
 
+	init_usb_anchor(&rt->out_anchor);
+	init_usb_anchor(&rt->in_anchor);
+	xonedb4_pcm_reset_timing(rt);
+
 	for (i = 0; i < PCM_N_URBS; i++) {
 		if ((chip->dev->ep_in[PCM_IN_EP]->desc.bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_BULK) {
 			ret = xonedb4_pcm_init_bulk_in_urbs(&rt->pcm_in_urbs[i], chip, PCM_IN_EP, xonedb4_pcm_in_urb_handler);
@@ -887,6 +1916,20 @@ int xonedb4_pcm_init_urbs(struct xonedb4_chip *chip)
 		}
 	}
 
+	rt->out_silence = kzalloc(XDB4_PCM_BULK_OUT_PACKET_SIZE, GFP_KERNEL);
+	if (!rt->out_silence) {
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	if ((chip->dev->ep_out[PCM_OUT_EP]->desc.bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_BULK) {
+		rt->out_packet_size = XDB4_PCM_BULK_OUT_PACKET_SIZE;
+		xonedb4_pcm_build_bulk_silence(rt->out_silence);
+	} else {
+		rt->out_packet_size = XDB4_PCM_INT_OUT_PACKET_SIZE;
+		xonedb4_pcm_build_int_silence(rt->out_silence);
+	}
+
 	for (i = 0; i < PCM_N_URBS; i++) {
 		if ((chip->dev->ep_out[PCM_OUT_EP]->desc.bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_BULK) {
 			ret = xonedb4_pcm_init_bulk_out_urbs(&rt->pcm_out_urbs[i], chip, PCM_OUT_EP, xonedb4_pcm_bulk_out_urb_handler);
@@ -900,44 +1943,148 @@ int xonedb4_pcm_init_urbs(struct xonedb4_chip *chip)
 		}
 	}
 
+	/* nothing is open yet, only MIDI OUT needs the endpoint */
 	mutex_lock(&rt->stream_mutex);
-	for (i = 0; i < PCM_N_URBS; i++) {
-		usb_anchor_urb(&rt->pcm_in_urbs[i].instance, &rt->pcm_in_urbs[i].submitted);
-		ret = usb_submit_urb(&rt->pcm_in_urbs[i].instance, GFP_ATOMIC);
-		if (ret < 0) {
-			xonedb4_pcm_stream_stop(rt);
-			xonedb4_pcm_kill_urbs(rt);
-			goto error;
-		}
-	}
-
-	for (i = 0; i < PCM_N_URBS; i++) {
-		usb_anchor_urb(&rt->pcm_out_urbs[i].instance, &rt->pcm_out_urbs[i].submitted);
-		ret = usb_submit_urb(&rt->pcm_out_urbs[i].instance, GFP_ATOMIC);
-		if (ret < 0) {
-			xonedb4_pcm_stream_stop(rt);
-			xonedb4_pcm_kill_urbs(rt);
-			goto error;
-		}
-	}
+	xonedb4_pcm_enter_idle(rt);
 	mutex_unlock(&rt->stream_mutex);
-	
+
 	return 0;
 
 	error:
 	dev_err(&chip->dev->dev, "%s: ERROR\n", __func__);
-	mutex_unlock(&rt->stream_mutex);
-	for (i = 0; i < PCM_N_URBS; i++)
-		kfree(rt->pcm_out_urbs[i].buffer);
+	xonedb4_pcm_free_urbs(rt);
 	return ret;
 }
 
+/* the card is going, xonedb4_pcm_abort poisoned the URBs so nothing reaches rt anymore */
+void xonedb4_pcm_free(struct xonedb4_chip *chip)
+{
+	struct pcm_runtime *rt = chip->pcm;
+
+	if (!rt)
+		return;
+
+	xonedb4_pcm_free_urbs(rt);
+	kfree(rt);
+	chip->pcm = NULL;
+}
+
+
+static void xonedb4_pcm_init_substream(struct pcm_runtime *rt, struct pcm_substream *sub, int stream, int device)
+{
+	spin_lock_init(&sub->lock);
+	sub->rt = rt;
+	sub->stream = stream;
+	sub->first_channel = device ? (device - 1) * 2 : 0;
+	sub->format = SNDRV_PCM_FORMAT_S24_3LE;
+	sub->channels = device ? 2 : PCM_N_PLAYBACK_CHANNELS;
+	sub->frame_bytes = sub->channels * ALSA_BYTES_PER_SAMPLE;
+	sub->packet_frames = stream == SNDRV_PCM_STREAM_PLAYBACK ? XDB4_PCM_OUT_FRAMES_PER_PACKET : XDB4_PCM_IN_FRAMES_PER_PACKET;
+	hrtimer_setup(&sub->period_timer, xonedb4_pcm_period_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+}
+
+/*
+ * device 0 carries all channels, devices 1 to PCM_N_PAIRS one stereo pair
+ * each, PCM_LOOPBACK_DEVICE captures what goes out, PCM_RAW_DEVICE skips
+ * the conversion
+ */
+static int xonedb4_pcm_new(struct pcm_runtime *rt, int device)
+{
+	struct xonedb4_chip *chip = rt->chip;
+	bool loopback = device == PCM_LOOPBACK_DEVICE;
+	struct snd_pcm *pcm;
+	int ret;
+
+	ret = snd_pcm_new(chip->card, chip->dev->product, device, loopback ? 0 : 1, 1, &pcm);
+	if (ret < 0) {
+		dev_err(&chip->dev->dev, "%s: Cannot create PCM instance %d\n", __func__, device);
+		return ret;
+	}
+
+	pcm->private_data = rt;
+
+	if (device == 0)
+		strscpy(pcm->name, chip->dev->product, sizeof(pcm->name));
+	else if (loopback)
+		snprintf(pcm->name, sizeof(pcm->name), "%s Loopback", chip->dev->product);
+	else if (device == PCM_RAW_DEVICE)
+		snprintf(pcm->name, sizeof(pcm->name), "%s Raw", chip->dev->product);
+	else
+		snprintf(pcm->name, sizeof(pcm->name), "%s %u-%u", chip->dev->product, (device - 1) * 2 + 1, (device - 1) * 2 + 2);
+	if (!loopback)
+		snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &pcm_ops);
+	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &pcm_ops);
+	snd_pcm_set_managed_buffer_all(pcm, SNDRV_DMA_TYPE_VMALLOC, NULL, 0, 0);
+
+	rt->instances[device] = pcm;
+	return 0;
+}
+
+static int xonedb4_pcm_timer_init(struct pcm_runtime *rt)
+{
+	struct xonedb4_chip *chip = rt->chip;
+	struct snd_timer_id tid = {
+		.dev_class = SNDRV_TIMER_CLASS_CARD,
+		.dev_sclass = SNDRV_TIMER_SCLASS_NONE,
+		.card = chip->card->number,
+		.device = 0,
+		.subdevice = 0
+	};
+	struct snd_timer *timer;
+	int ret;
+
+	ret = snd_timer_new(chip->card, "xonedb4", &tid, &timer);
+	if (ret < 0) {
+		dev_err(&chip->dev->dev, "%s: Cannot create timer\n", __func__);
+		return ret;
+	}
+
+	snprintf(timer->name, sizeof(timer->name), "%s USB clock", chip->dev->product);
+	timer->hw = timer_hw;
+	timer->private_data = rt;
+	rt->timer = timer;
+	return 0;
+}
+
+static int xonedb4_pcm_route_init(struct pcm_runtime *rt)
+{
+	int i;
+	int ret;
+
+	rt->route[SNDRV_PCM_STREAM_PLAYBACK] = XDB4_ROUTE_IDENTITY;
+	rt->route[SNDRV_PCM_STREAM_CAPTURE] = XDB4_ROUTE_IDENTITY;
+
+	for (i = 0; i < ARRAY_SIZE(route_controls); i++) {
+		ret = snd_ctl_add(rt->chip->card, snd_ctl_new1(&route_controls[i], rt));
+		if (ret < 0) {
+			dev_err(&rt->chip->dev->dev, "%s: Cannot add control!\n", __func__);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/* the PCM instances and the timer stay until the card goes, they must not reach rt anymore */
+static void xonedb4_pcm_init_failed(struct pcm_runtime *rt)
+{
+	int i;
+
+	for (i = 0; i < PCM_N_INSTANCES; i++) {
+		if (rt->instances[i])
+			rt->instances[i]->private_data = NULL;
+	}
+	if (rt->timer)
+		rt->timer->private_data = NULL;
+	rt->chip->pcm = NULL;
+	kfree(rt);
+}
 
 int xonedb4_pcm_init(struct xonedb4_chip *chip)
 {
 	int ret;
+	int i;
 
-	struct snd_pcm *pcm;
 	struct pcm_runtime *rt = kzalloc(sizeof(struct pcm_runtime), GFP_KERNEL);
 	if (!rt) {
 		return -ENOMEM;
@@ -947,24 +2094,63 @@ int xonedb4_pcm_init(struct xonedb4_chip *chip)
 	rt->stream_state = STREAM_DISABLED;
 
 	mutex_init(&rt->stream_mutex);
-	spin_lock_init(&rt->playback.lock);
+	for (i = 0; i < PCM_N_DEVICES; i++) {
+		xonedb4_pcm_init_substream(rt, &rt->playback[i], SNDRV_PCM_STREAM_PLAYBACK, i);
+		xonedb4_pcm_init_substream(rt, &rt->capture[i], SNDRV_PCM_STREAM_CAPTURE, i);
+	}
+	/* all channels, but in OUT packets */
+	xonedb4_pcm_init_substream(rt, &rt->loopback, SNDRV_PCM_STREAM_CAPTURE, 0);
+	rt->loopback.packet_frames = XDB4_PCM_OUT_FRAMES_PER_PACKET;
+	/* one S8 "channel" per byte of a device frame */
+	xonedb4_pcm_init_substream(rt, &rt->raw_playback, SNDRV_PCM_STREAM_PLAYBACK, 0);
+	xonedb4_pcm_init_substream(rt, &rt->raw_capture, SNDRV_PCM_STREAM_CAPTURE, 0);
+	rt->raw_playback.format = SNDRV_PCM_FORMAT_S8;
+	rt->raw_playback.channels = XDB4_PCM_OUT_FRAME_SIZE;
+	rt->raw_playback.frame_bytes = XDB4_PCM_OUT_FRAME_SIZE;
+	rt->raw_capture.format = SNDRV_PCM_FORMAT_S8;
+	rt->raw_capture.channels = XDB4_PCM_IN_FRAME_SIZE;
+	rt->raw_capture.frame_bytes = XDB4_PCM_IN_FRAME_SIZE;
+	spin_lock_init(&rt->idle_lock);
+	INIT_WORK(&rt->recovery_work, xonedb4_pcm_recovery_work);
+	INIT_WORK(&rt->timer_work, xonedb4_pcm_timer_work);
+	hrtimer_setup(&rt->idle_timer, xonedb4_pcm_idle_keepalive, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	for (i = 0; i < XDB4_STATS_N_DIRS; i++) {
+		rt->watchdog[i].rt = rt;
+		rt->watchdog[i].dir = i;
+		hrtimer_setup(&rt->watchdog[i].timer, xonedb4_pcm_watchdog, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	}
+
+	for (i = 0; i < PCM_N_INSTANCES; i++) {
+		if (i == PCM_RAW_DEVICE && !raw_pcm)
+			continue;
+		ret = xonedb4_pcm_new(rt, i);
+		if (ret < 0) {
+			xonedb4_pcm_init_failed(rt);
+			return ret;
+		}
+	}
+
+	chip->pcm = rt;
 
-	ret = snd_pcm_new(chip->card, chip->dev->product, 0, 1, 1, &pcm);
+	ret = xonedb4_pcm_timer_init(rt);
 	if (ret < 0) {
-		kfree(rt);
-		dev_err(&chip->dev->dev, "%s: Cannot create PCM instance\n", __func__);
-		return ret;
+		goto error;
 	}
 
-	pcm->private_data = rt;
+	ret = xonedb4_pcm_route_init(rt);
+	if (ret < 0) {
+		goto error;
+	}
 
-	strscpy(pcm->name, chip->dev->product, sizeof(pcm->name));
-	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &pcm_ops);
-	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &pcm_ops);
-	snd_pcm_set_managed_buffer_all(pcm, SNDRV_DMA_TYPE_VMALLOC, NULL, 0, 0);
+	ret = xonedb4_clock_init(chip, &rt->clock);
+	if (ret < 0) {
+		goto error;
+	}
 
-	rt->instance = pcm;
-	chip->pcm = rt;
+	ret = xonedb4_stats_init(chip, &rt->stats);
+	if (ret < 0) {
+		goto error;
+	}
 
 	ret = xonedb4_pcm_init_urbs(chip);
 
@@ -976,6 +2162,6 @@ int xonedb4_pcm_init(struct xonedb4_chip *chip)
 
 	error:
 	dev_err(&chip->dev->dev, "%s: ERROR\n", __func__);
-	kfree(rt);
+	xonedb4_pcm_init_failed(rt);
 	return ret;
 }
@@ -6,4 +6,9 @@ struct xonedb4_chip;
 int xonedb4_pcm_init(struct xonedb4_chip *chip);
 int xonedb4_pcm_init_urbs(struct xonedb4_chip *chip);
 void xonedb4_pcm_abort(struct xonedb4_chip *chip);
+void xonedb4_pcm_free(struct xonedb4_chip *chip);
+void xonedb4_pcm_stop_urbs(struct xonedb4_chip *chip);
+int xonedb4_pcm_start_urbs(struct xonedb4_chip *chip);
+void xonedb4_pcm_suspend(struct xonedb4_chip *chip);
+void xonedb4_pcm_kick_midi(struct xonedb4_chip *chip);
 #endif /* XONEDB4_PCM_H */
@@ -0,0 +1,134 @@
+#include <linux/slab.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+#include "recorder.h"
+#include "chip.h"
+
+static const char * const kind_names[XDB4_REC_N_KINDS] = { "out", "in", "midi", "xrun" };
+
+/* called from the completion handlers, does nothing once frozen */
+void xonedb4_recorder_add(struct xonedb4_recorder *rec, const struct xonedb4_record *r)
+{
+	struct xonedb4_record *e;
+	u32 pos;
+
+	if (READ_ONCE(rec->frozen))
+		return;
+
+	pos = atomic_inc_return(&rec->head) - 1;
+	e = &rec->ring[pos & (XDB4_REC_ENTRIES - 1)];
+
+	WRITE_ONCE(e->seq, 0);
+	smp_wmb();
+	e->kind = r->kind;
+	e->index = r->index;
+	e->n_midi = min_t(u8, r->n_midi, XDB4_REC_MIDI_BYTES);
+	memcpy(e->midi, r->midi, e->n_midi);
+	e->status = r->status;
+	e->length = r->length;
+	e->dma_before = r->dma_before;
+	e->dma_after = r->dma_after;
+	e->time = r->time;
+	smp_wmb();
+	WRITE_ONCE(e->seq, pos + 1);
+}
+
+/* marks the xrun in the ring, then keeps it as it is if freeze_on_xrun is set (off by default) */
+void xonedb4_recorder_xrun(struct xonedb4_recorder *rec, int stream)
+{
+	struct xonedb4_record r = {
+		.kind = XDB4_REC_XRUN,
+		.index = stream,
+		.time = ktime_get_ns()
+	};
+
+	xonedb4_recorder_add(rec, &r);
+	if (READ_ONCE(rec->freeze_on_xrun))
+		WRITE_ONCE(rec->frozen, true);
+}
+
+static int xonedb4_recorder_show(struct seq_file *m, void *v)
+{
+	struct xonedb4_recorder *rec = m->private;
+	struct xonedb4_record r;
+	u32 head = atomic_read(&rec->head);
+	u32 pos = head > XDB4_REC_ENTRIES ? head - XDB4_REC_ENTRIES : 0;
+	const struct xonedb4_record *e;
+	u32 seq;
+	u32 rem;
+	u64 sec;
+	int i;
+
+	seq_printf(m, "%s, %u records\n", READ_ONCE(rec->frozen) ? "frozen" : "recording", head);
+
+	for (; pos != head; pos++) {
+		e = &rec->ring[pos & (XDB4_REC_ENTRIES - 1)];
+
+		seq = READ_ONCE(e->seq);
+		smp_rmb();
+		r = *e;
+		smp_rmb();
+		if (seq != pos + 1 || READ_ONCE(e->seq) != seq)
+			continue; /* being written, or already overwritten */
+
+		sec = div_u64_rem(r.time, NSEC_PER_SEC, &rem);
+		seq_printf(m, "%llu.%06u %-4s urb=%u status=%d len=%u dma=%u->%u",
+			   sec, (u32)(rem / NSEC_PER_USEC), r.kind < XDB4_REC_N_KINDS ? kind_names[r.kind] : "?",
+			   r.index, r.status, r.length, r.dma_before, r.dma_after);
+		if (r.n_midi) {
+			seq_puts(m, " midi=");
+			for (i = 0; i < min_t(u8, r.n_midi, XDB4_REC_MIDI_BYTES); i++)
+				seq_printf(m, "%02x", r.midi[i]);
+		}
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(xonedb4_recorder);
+
+int xonedb4_recorder_init(struct xonedb4_chip *chip)
+{
+	struct xonedb4_recorder *rec;
+	char name[32];
+
+	rec = kzalloc(sizeof(*rec), GFP_KERNEL);
+	if (!rec)
+		return -ENOMEM;
+
+	rec->ring = kvcalloc(XDB4_REC_ENTRIES, sizeof(*rec->ring), GFP_KERNEL);
+	if (!rec->ring) {
+		kfree(rec);
+		return -ENOMEM;
+	}
+
+	atomic_set(&rec->head, 0);
+	rec->freeze_on_xrun = false;
+
+	/* debugfs is optional, the recorder runs either way */
+	snprintf(name, sizeof(name), "xonedb4-card%d", chip->card->number);
+	rec->dir = debugfs_create_dir(name, NULL);
+	debugfs_create_file("recorder", 0400, rec->dir, rec, &xonedb4_recorder_fops);
+	debugfs_create_bool("frozen", 0600, rec->dir, &rec->frozen);
+	debugfs_create_bool("freeze_on_xrun", 0600, rec->dir, &rec->freeze_on_xrun);
+
+	chip->recorder = rec;
+	return 0;
+}
+
+/* call once no URB can complete anymore */
+void xonedb4_recorder_free(struct xonedb4_chip *chip)
+{
+	struct xonedb4_recorder *rec = chip->recorder;
+
+	if (!rec)
+		return;
+
+	debugfs_remove_recursive(rec->dir);
+	kvfree(rec->ring);
+	kfree(rec);
+	chip->recorder = NULL;
+}
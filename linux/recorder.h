@@ -0,0 +1,52 @@
+#ifndef XONEDB4_RECORDER_H
+#define XONEDB4_RECORDER_H
+
+#include <linux/types.h>
+#include <linux/atomic.h>
+
+struct xonedb4_chip;
+struct dentry;
+
+#define XDB4_REC_ENTRIES		1024 /* power of two */
+#define XDB4_REC_MIDI_BYTES		9
+
+enum { /* what a record is about */
+	XDB4_REC_PCM_OUT,
+	XDB4_REC_PCM_IN,
+	XDB4_REC_MIDI_IN,
+	XDB4_REC_XRUN, /* reported by the driver or seen at prepare */
+	XDB4_REC_N_KINDS
+};
+
+struct xonedb4_record {
+	u32 seq; /* position + 1 once written, 0 while a writer is on it */
+	u8 kind; /* XDB4_REC_XXX */
+	u8 index; /* URB, or SNDRV_PCM_STREAM_XXX for an xrun */
+	u8 n_midi;
+	u8 midi[XDB4_REC_MIDI_BYTES]; /* MIDI IN received, or MIDI OUT going out with the resubmitted packet */
+	s32 status;
+	u32 length; /* actual_length */
+	u32 dma_before; /* byte offset of the first running substream, before and after the packet */
+	u32 dma_after;
+	u64 time; /* ns */
+};
+
+/*
+ * Flight recorder of the recent URB completions. Writers claim a slot
+ * with one atomic increment and publish it through its seq, so the
+ * completion handlers never wait on each other or on a reader. Readers
+ * skip slots that change under them.
+ */
+struct xonedb4_recorder {
+	atomic_t head; /* next position to claim */
+	bool frozen; /* no more records, the ring holds what led up to it */
+	bool freeze_on_xrun; /* off by default, "echo 1 > freeze_on_xrun" in debugfs to keep the ring of the first xrun */
+	struct dentry *dir;
+	struct xonedb4_record *ring;
+};
+
+void xonedb4_recorder_add(struct xonedb4_recorder *rec, const struct xonedb4_record *r);
+void xonedb4_recorder_xrun(struct xonedb4_recorder *rec, int stream);
+int xonedb4_recorder_init(struct xonedb4_chip *chip);
+void xonedb4_recorder_free(struct xonedb4_chip *chip);
+#endif /* XONEDB4_RECORDER_H */
@@ -0,0 +1,146 @@
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <sound/info.h>
+
+#include "stats.h"
+#include "chip.h"
+
+#define STATS_JITTER_SHIFT		10 /* first bucket ends at 1024 ns */
+
+static const char * const dir_names[XDB4_STATS_N_DIRS] = { "playback", "capture" };
+
+static const char * const error_names[XDB4_STATS_N_ERRORS] = {
+	"proto", "ilseq", "overflow", "stall", "timeout", "unlinked", "shutdown", "other"
+};
+
+/* keeps the counters, only forgets the previous completion */
+void xonedb4_stats_restart(struct xonedb4_stats_dir *dir, unsigned int rate, unsigned int frames)
+{
+	dir->nominal = div_u64((u64) frames * NSEC_PER_SEC, rate);
+	dir->last = 0;
+}
+
+void xonedb4_stats_complete(struct xonedb4_stats_dir *dir, ktime_t now)
+{
+	s64 ns = ktime_to_ns(now);
+	u64 interval, jitter;
+	int bucket;
+
+	dir->completions++;
+
+	if (dir->last) {
+		interval = ns - dir->last;
+		jitter = interval > dir->nominal ? interval - dir->nominal : dir->nominal - interval;
+
+		if (!dir->intervals || interval < dir->interval_min)
+			dir->interval_min = interval;
+		if (interval > dir->interval_max)
+			dir->interval_max = interval;
+		dir->interval_sum += interval;
+		dir->intervals++;
+
+		bucket = jitter >> STATS_JITTER_SHIFT ? ilog2(jitter) - STATS_JITTER_SHIFT + 1 : 0;
+		dir->jitter[min(bucket, XDB4_STATS_N_BUCKETS - 1)]++;
+	}
+
+	dir->last = ns;
+}
+
+void xonedb4_stats_urb_error(struct xonedb4_stats_dir *dir, int status)
+{
+	switch (status) {
+	case -EPROTO:
+		dir->errors[XDB4_STATS_ERR_PROTO]++;
+		break;
+	case -EILSEQ:
+		dir->errors[XDB4_STATS_ERR_ILSEQ]++;
+		break;
+	case -EOVERFLOW:
+		dir->errors[XDB4_STATS_ERR_OVERFLOW]++;
+		break;
+	case -EPIPE:
+		dir->errors[XDB4_STATS_ERR_STALL]++;
+		break;
+	case -ETIME:
+		dir->errors[XDB4_STATS_ERR_TIMEOUT]++;
+		break;
+	case -ENOENT:
+	case -ECONNRESET:
+		dir->errors[XDB4_STATS_ERR_UNLINKED]++;
+		break;
+	case -ENODEV:
+	case -ESHUTDOWN:
+		dir->errors[XDB4_STATS_ERR_SHUTDOWN]++;
+		break;
+	default:
+		dir->errors[XDB4_STATS_ERR_OTHER]++;
+	}
+}
+
+void xonedb4_stats_convert(struct xonedb4_stats_dir *dir, ktime_t start, ktime_t end)
+{
+	u64 ns = ktime_to_ns(ktime_sub(end, start));
+
+	if (!dir->converts || ns < dir->convert_min)
+		dir->convert_min = ns;
+	if (ns > dir->convert_max)
+		dir->convert_max = ns;
+	dir->convert_sum += ns;
+	dir->converts++;
+}
+
+/* called whenever the PCM URBs were stopped */
+void xonedb4_stats_stop(struct xonedb4_stats *stats, ktime_t start, ktime_t end)
+{
+	u64 ns = ktime_to_ns(ktime_sub(end, start));
+
+	stats->stop_last = ns;
+	if (ns > stats->stop_max)
+		stats->stop_max = ns;
+	stats->stops++;
+}
+
+static void xonedb4_stats_proc_read(struct snd_info_entry *entry, struct snd_info_buffer *buffer)
+{
+	struct xonedb4_stats *stats = entry->private_data;
+	struct xonedb4_stats_dir *dir;
+	u64 intervals, converts;
+	int d, i;
+
+	for (d = 0; d < XDB4_STATS_N_DIRS; d++) {
+		dir = &stats->dir[d];
+		intervals = READ_ONCE(dir->intervals);
+		converts = READ_ONCE(dir->converts);
+
+		snd_iprintf(buffer, "%s:\n", dir_names[d]);
+		snd_iprintf(buffer, "  completions: %llu\n", dir->completions);
+		snd_iprintf(buffer, "  period wakeups: %llu\n", (u64) atomic64_read(&dir->periods));
+		snd_iprintf(buffer, "  xruns: %llu\n", (u64) atomic64_read(&dir->xruns));
+		snd_iprintf(buffer, "  stalls: %llu\n", (u64) atomic64_read(&dir->stalls));
+		snd_iprintf(buffer, "  submit failures: %llu\n", dir->submit_failures);
+
+		snd_iprintf(buffer, "  urb errors:");
+		for (i = 0; i < XDB4_STATS_N_ERRORS; i++)
+			snd_iprintf(buffer, " %s %llu", error_names[i], dir->errors[i]);
+		snd_iprintf(buffer, "\n");
+
+		snd_iprintf(buffer, "  interval: min %llu avg %llu max %llu ns (nominal %llu)\n",
+			    dir->interval_min, intervals ? div64_u64(dir->interval_sum, intervals) : 0,
+			    dir->interval_max, dir->nominal);
+		snd_iprintf(buffer, "  conversion: min %llu avg %llu max %llu ns\n",
+			    dir->convert_min, converts ? div64_u64(dir->convert_sum, converts) : 0,
+			    dir->convert_max);
+
+		snd_iprintf(buffer, "  interval jitter:\n");
+		snd_iprintf(buffer, "    < %llu ns: %llu\n", 1ULL << STATS_JITTER_SHIFT, dir->jitter[0]);
+		for (i = 1; i < XDB4_STATS_N_BUCKETS; i++)
+			snd_iprintf(buffer, "    >= %llu ns: %llu\n", 1ULL << (STATS_JITTER_SHIFT + i - 1), dir->jitter[i]);
+	}
+
+	snd_iprintf(buffer, "stop latency: last %llu max %llu ns (%llu stops)\n", stats->stop_last, stats->stop_max, stats->stops);
+}
+
+int xonedb4_stats_init(struct xonedb4_chip *chip, struct xonedb4_stats *stats)
+{
+	return snd_card_ro_proc_new(chip->card, "xonedb4_stats", stats, xonedb4_stats_proc_read);
+}
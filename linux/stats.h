@@ -0,0 +1,74 @@
+#ifndef XONEDB4_STATS_H
+#define XONEDB4_STATS_H
+
+#include <linux/ktime.h>
+#include <linux/atomic.h>
+
+struct xonedb4_chip;
+
+enum { /* stream directions */
+	XDB4_STATS_PLAYBACK,
+	XDB4_STATS_CAPTURE,
+	XDB4_STATS_N_DIRS
+};
+
+enum { /* URB completion errors */
+	XDB4_STATS_ERR_PROTO, /* -EPROTO, bitstuff or no response */
+	XDB4_STATS_ERR_ILSEQ, /* -EILSEQ, CRC mismatch */
+	XDB4_STATS_ERR_OVERFLOW, /* -EOVERFLOW, babble */
+	XDB4_STATS_ERR_STALL, /* -EPIPE */
+	XDB4_STATS_ERR_TIMEOUT, /* -ETIME */
+	XDB4_STATS_ERR_UNLINKED, /* -ENOENT, -ECONNRESET */
+	XDB4_STATS_ERR_SHUTDOWN, /* -ENODEV, -ESHUTDOWN */
+	XDB4_STATS_ERR_OTHER,
+	XDB4_STATS_N_ERRORS
+};
+
+#define XDB4_STATS_N_BUCKETS	16 /* log2 buckets of the interval jitter, from 1 us up */
+
+/*
+ * Counters of one direction. The plain ones are only written by the
+ * completion handlers of that direction, which the host controller runs
+ * one at a time, so they go without a lock. The atomic ones are also
+ * written from elsewhere: periods by the period hrtimers and, for the
+ * loopback, by the OUT handler; xruns by the pointer callback and
+ * recovery_work; stalls by the watchdog.
+ */
+struct xonedb4_stats_dir {
+	u64 completions;
+	u64 errors[XDB4_STATS_N_ERRORS];
+	u64 submit_failures;
+	atomic64_t periods;
+	atomic64_t xruns;
+	atomic64_t stalls; /* watchdog found no completion in time */
+
+	u64 nominal; /* expected completion interval in ns */
+	s64 last; /* time of the previous completion in ns, 0 after a restart */
+	u64 intervals;
+	u64 interval_sum;
+	u64 interval_min;
+	u64 interval_max;
+	u64 jitter[XDB4_STATS_N_BUCKETS];
+
+	u64 converts;
+	u64 convert_sum;
+	u64 convert_min;
+	u64 convert_max;
+};
+
+struct xonedb4_stats {
+	struct xonedb4_stats_dir dir[XDB4_STATS_N_DIRS];
+
+	/* time to get all PCM URBs out of flight, in ns */
+	u64 stops;
+	u64 stop_last;
+	u64 stop_max;
+};
+
+void xonedb4_stats_restart(struct xonedb4_stats_dir *dir, unsigned int rate, unsigned int frames);
+void xonedb4_stats_complete(struct xonedb4_stats_dir *dir, ktime_t now);
+void xonedb4_stats_urb_error(struct xonedb4_stats_dir *dir, int status);
+void xonedb4_stats_convert(struct xonedb4_stats_dir *dir, ktime_t start, ktime_t end);
+void xonedb4_stats_stop(struct xonedb4_stats *stats, ktime_t start, ktime_t end);
+int xonedb4_stats_init(struct xonedb4_chip *chip, struct xonedb4_stats *stats);
+#endif /* XONEDB4_STATS_H */
@@ -0,0 +1,905 @@
+/*
+ * Userspace emulator of a Ploytec based Xone, for testing snd-usb-xonedb4
+ * without the hardware. Runs on raw-gadget, usually bound to dummy_hcd:
+ *
+ *   modprobe dummy_hcd
+ *   modprobe raw_gadget
+ *   ./xonedb4-emu -m int -L
+ *
+ * The driver then probes the emulated device like a real one. The emulator
+ * answers the vendor requests of chip.c, consumes OUT (EP 5) and produces
+ * IN (EP 6) packets paced at the selected samplerate, and can loop the OUT
+ * audio and MIDI back to the IN endpoints (EP 6 and EP 3).
+ */
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#define EMU_VENDOR_ID			0x0a4a
+#define EMU_PRODUCT_ID			0xffdb
+
+#define EMU_PCM_OUT_EP			0x05
+#define EMU_PCM_IN_EP			0x86
+#define EMU_MIDI_IN_EP			0x83
+
+#define OUT_FRAME_SIZE			48
+#define IN_FRAME_SIZE			64
+#define OUT_FRAMES_PER_PACKET	40
+#define IN_FRAMES_PER_PACKET	32
+#define BULK_OUT_PACKET_SIZE	2048
+#define INT_OUT_PACKET_SIZE		1928
+#define IN_PACKET_SIZE			(IN_FRAMES_PER_PACKET * IN_FRAME_SIZE)
+#define MIDI_IN_PACKET_SIZE		9
+
+#define N_CHANNELS				8
+#define BYTES_PER_FRAME			(N_CHANNELS * 3) /* S24_3LE */
+#define FIFO_FRAMES				(1 << 17) /* over a second at 96 kHz */
+
+#define MIDI_IDLE				0xFD
+
+/* status bits of the 0x49 request, as in chip.h */
+#define STATUS_STABLE			0x01
+#define STATUS_STREAMING		0x02
+#define STATUS_CLOCK_LOCK		0x04
+
+#define EP0_MAX_DATA			256
+
+enum { /* what happens to a transfer picked by the error injection */
+	INJECT_DROP, /* the device misses four packet periods */
+	INJECT_STALL, /* the endpoint halts until the host clears it */
+	INJECT_SHORT /* IN packets only, half a packet is sent */
+};
+
+struct emu_run {
+	uint8_t first;
+	uint8_t frames;
+	uint16_t offset;
+};
+
+static const struct emu_run bulk_out_runs[] = {
+	{ 0, 10, 0 }, { 10, 10, 512 }, { 20, 10, 1024 }, { 30, 10, 1536 }
+};
+
+static const struct emu_run int_out_runs[] = {
+	{ 0, 9, 0 }, { 9, 10, 434 }, { 19, 10, 916 }, { 29, 10, 1398 }, { 39, 1, 1880 }
+};
+
+static const uint16_t bulk_midi_offsets[] = { 480, 992, 1504, 2016 };
+static const uint16_t int_midi_offsets[] = { 432, 433, 914, 915, 1396, 1397, 1878, 1879 };
+
+static const unsigned int rates[] = { 44100, 48000, 88200, 96000 };
+
+struct emu_options {
+	const char *driver;
+	const char *device;
+	bool bulk;
+	unsigned int rate;
+	unsigned int firmware;
+	unsigned int lock_ms; /* clock lock time after a rate change */
+	unsigned int latency; /* loopback latency in frames */
+	unsigned int jitter_us; /* max deviation of a completion from its slot */
+	unsigned int error_rate; /* one in error_rate transfers fails, 0 for none */
+	int error_kind;
+	bool loopback;
+	bool verbose;
+};
+
+struct emu_fifo {
+	pthread_mutex_t lock;
+	uint8_t *frames;
+	unsigned int head; /* in frames */
+	unsigned int fill;
+	unsigned long underruns;
+	unsigned long overruns;
+};
+
+struct emu_counters {
+	unsigned long packets;
+	unsigned long late; /* packets that missed their slot */
+	unsigned long injected;
+};
+
+struct emu {
+	struct emu_options opt;
+	int fd;
+
+	pthread_mutex_t lock;
+	unsigned int rate;
+	struct timespec lock_at; /* the clock is locked from then on */
+	bool configured;
+	bool streaming;
+	int ep_out, ep_in, ep_midi; /* raw-gadget handles */
+	pthread_t out_thread, in_thread, midi_thread;
+
+	struct emu_fifo fifo;
+	int midi_pipe[2];
+
+	struct emu_counters out, in;
+	unsigned long midi_out, midi_in;
+};
+
+static volatile sig_atomic_t stop;
+
+static void emu_on_signal(int sig)
+{
+	stop = 1;
+}
+
+static int64_t emu_ts_ns(const struct timespec *ts)
+{
+	return (int64_t) ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static struct timespec emu_ns_ts(int64_t ns)
+{
+	struct timespec ts = { .tv_sec = ns / 1000000000LL, .tv_nsec = ns % 1000000000LL };
+
+	return ts;
+}
+
+static int64_t emu_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return emu_ts_ns(&ts);
+}
+
+static bool emu_inject(struct emu *emu, struct emu_counters *cnt)
+{
+	if (!emu->opt.error_rate || random() % emu->opt.error_rate)
+		return false;
+
+	cnt->injected++;
+	return true;
+}
+
+/* sleeps until the packet slot at next, give or take the configured jitter */
+static void emu_wait_slot(struct emu *emu, int64_t next)
+{
+	struct timespec ts;
+	int64_t jitter = emu->opt.jitter_us * 1000LL;
+
+	if (jitter)
+		next += (random() % (2 * jitter + 1)) - jitter;
+	ts = emu_ns_ts(next);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !stop)
+		;
+}
+
+static int64_t emu_packet_ns(struct emu *emu, unsigned int frames)
+{
+	unsigned int rate;
+
+	pthread_mutex_lock(&emu->lock);
+	rate = emu->rate;
+	pthread_mutex_unlock(&emu->lock);
+
+	return (int64_t) frames * 1000000000LL / rate;
+}
+
+/* the slot after prev, restarts from now if the host left the endpoint alone */
+static int64_t emu_next_slot(struct emu *emu, struct emu_counters *cnt, int64_t prev, int64_t period)
+{
+	int64_t now = emu_now();
+	int64_t next = prev + period;
+
+	if (now > next + 4 * period)
+		return now;
+	if (now > next)
+		cnt->late++;
+	return next;
+}
+
+/* inverse of ploytec_convert_from_s24_3le, 48 bytes in, 24 bytes out */
+static void emu_decode_out_frame(uint8_t *dest, const uint8_t *src)
+{
+	unsigned int ch, byte, bit;
+	unsigned int idx;
+
+	memset(dest, 0, 24);
+	for (ch = 0; ch < N_CHANNELS; ch++) {
+		for (byte = 0; byte < 3; byte++) {
+			for (bit = 0; bit < 8; bit++) {
+				idx = (ch & 1 ? 0x18 : 0) + (2 - byte) * 8 + (7 - bit);
+				if (src[idx] & (1 << (ch >> 1)))
+					dest[ch * 3 + byte] |= 1 << bit;
+			}
+		}
+	}
+}
+
+/* inverse of ploytec_convert_to_s24_3le, 24 bytes in, 64 bytes out */
+static void emu_encode_in_frame(uint8_t *dest, const uint8_t *src)
+{
+	unsigned int ch, byte, bit;
+	unsigned int idx;
+
+	memset(dest, 0, 64);
+	for (ch = 0; ch < N_CHANNELS; ch++) {
+		for (byte = 0; byte < 3; byte++) {
+			for (bit = 0; bit < 8; bit++) {
+				idx = (ch & 1 ? 0x20 : 0) + (2 - byte) * 8 + (7 - bit);
+				if (src[ch * 3 + byte] & (1 << bit))
+					dest[idx] |= 1 << (ch >> 1);
+			}
+		}
+	}
+}
+
+static void emu_fifo_reset(struct emu_fifo *fifo, unsigned int latency)
+{
+	pthread_mutex_lock(&fifo->lock);
+	memset(fifo->frames, 0, (size_t) FIFO_FRAMES * BYTES_PER_FRAME);
+	fifo->head = 0;
+	fifo->fill = latency;
+	pthread_mutex_unlock(&fifo->lock);
+}
+
+static void emu_fifo_put(struct emu_fifo *fifo, const uint8_t *frame)
+{
+	unsigned int tail;
+
+	pthread_mutex_lock(&fifo->lock);
+	if (fifo->fill == FIFO_FRAMES) {
+		fifo->head = (fifo->head + 1) % FIFO_FRAMES;
+		fifo->fill--;
+		fifo->overruns++;
+	}
+	tail = (fifo->head + fifo->fill) % FIFO_FRAMES;
+	memcpy(fifo->frames + (size_t) tail * BYTES_PER_FRAME, frame, BYTES_PER_FRAME);
+	fifo->fill++;
+	pthread_mutex_unlock(&fifo->lock);
+}
+
+static void emu_fifo_get(struct emu_fifo *fifo, uint8_t *frame)
+{
+	pthread_mutex_lock(&fifo->lock);
+	if (!fifo->fill) {
+		memset(frame, 0, BYTES_PER_FRAME);
+		fifo->underruns++;
+	} else {
+		memcpy(frame, fifo->frames + (size_t) fifo->head * BYTES_PER_FRAME, BYTES_PER_FRAME);
+		fifo->head = (fifo->head + 1) % FIFO_FRAMES;
+		fifo->fill--;
+	}
+	pthread_mutex_unlock(&fifo->lock);
+}
+
+static int emu_ep_io(struct emu *emu, unsigned long req, int ep, uint8_t *data, unsigned int len)
+{
+	struct {
+		struct usb_raw_ep_io io;
+		uint8_t data[BULK_OUT_PACKET_SIZE];
+	} buf;
+	int ret;
+
+	buf.io.ep = ep;
+	buf.io.flags = 0;
+	buf.io.length = len;
+	if (req == USB_RAW_IOCTL_EP_WRITE)
+		memcpy(buf.data, data, len);
+
+	ret = ioctl(emu->fd, req, &buf.io);
+	if (ret > 0 && req == USB_RAW_IOCTL_EP_READ)
+		memcpy(data, buf.data, ret);
+	return ret;
+}
+
+static void emu_halt(struct emu *emu, int ep)
+{
+	if (ioctl(emu->fd, USB_RAW_IOCTL_EP_SET_HALT, ep) < 0)
+		perror("EP_SET_HALT");
+}
+
+/* EP 5: takes the host's packets at the device rate */
+static void *emu_out_thread(void *arg)
+{
+	struct emu *emu = arg;
+	const struct emu_run *runs = emu->opt.bulk ? bulk_out_runs : int_out_runs;
+	unsigned int n_runs = emu->opt.bulk ? 4 : 5;
+	const uint16_t *midi = emu->opt.bulk ? bulk_midi_offsets : int_midi_offsets;
+	unsigned int n_midi = emu->opt.bulk ? 4 : 8;
+	unsigned int size = emu->opt.bulk ? BULK_OUT_PACKET_SIZE : INT_OUT_PACKET_SIZE;
+	uint8_t packet[BULK_OUT_PACKET_SIZE];
+	uint8_t frame[BYTES_PER_FRAME];
+	int64_t next = emu_now();
+	int64_t period;
+	unsigned int i, j;
+	int ret;
+
+	while (!stop) {
+		period = emu_packet_ns(emu, OUT_FRAMES_PER_PACKET);
+		next = emu_next_slot(emu, &emu->out, next, period);
+		emu_wait_slot(emu, next);
+
+		if (emu_inject(emu, &emu->out)) {
+			if (emu->opt.error_kind == INJECT_STALL) {
+				emu_halt(emu, emu->ep_out);
+				continue;
+			} else if (emu->opt.error_kind == INJECT_DROP) {
+				next += 4 * period;
+				continue;
+			}
+		}
+
+		ret = emu_ep_io(emu, USB_RAW_IOCTL_EP_READ, emu->ep_out, packet, size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ESHUTDOWN)
+				perror("EP 5 read");
+			break;
+		}
+		emu->out.packets++;
+
+		for (i = 0; i < n_midi; i++) {
+			if (packet[midi[i]] == MIDI_IDLE)
+				continue;
+			emu->midi_out++;
+			if (emu->opt.loopback && write(emu->midi_pipe[1], &packet[midi[i]], 1) < 0)
+				perror("MIDI loopback");
+		}
+
+		if (!emu->opt.loopback || ret < size)
+			continue;
+
+		for (i = 0; i < n_runs; i++) {
+			for (j = 0; j < runs[i].frames; j++) {
+				emu_decode_out_frame(frame, packet + runs[i].offset + j * OUT_FRAME_SIZE);
+				emu_fifo_put(&emu->fifo, frame);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* EP 6: hands the host a packet per slot, looped back or silent */
+static void *emu_in_thread(void *arg)
+{
+	struct emu *emu = arg;
+	uint8_t packet[IN_PACKET_SIZE];
+	uint8_t frame[BYTES_PER_FRAME];
+	unsigned int len;
+	int64_t next = emu_now();
+	int64_t period;
+	unsigned int i;
+	int ret;
+
+	while (!stop) {
+		period = emu_packet_ns(emu, IN_FRAMES_PER_PACKET);
+		next = emu_next_slot(emu, &emu->in, next, period);
+		emu_wait_slot(emu, next);
+
+		len = IN_PACKET_SIZE;
+		if (emu_inject(emu, &emu->in)) {
+			if (emu->opt.error_kind == INJECT_STALL) {
+				emu_halt(emu, emu->ep_in);
+				continue;
+			} else if (emu->opt.error_kind == INJECT_DROP) {
+				next += 4 * period;
+				continue;
+			}
+			len /= 2;
+		}
+
+		if (emu->opt.loopback) {
+			for (i = 0; i < IN_FRAMES_PER_PACKET; i++) {
+				emu_fifo_get(&emu->fifo, frame);
+				emu_encode_in_frame(packet + i * IN_FRAME_SIZE, frame);
+			}
+		} else {
+			memset(packet, 0, sizeof(packet));
+		}
+
+		ret = emu_ep_io(emu, USB_RAW_IOCTL_EP_WRITE, emu->ep_in, packet, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ESHUTDOWN)
+				perror("EP 6 write");
+			break;
+		}
+		emu->in.packets++;
+	}
+
+	return NULL;
+}
+
+/* EP 3: MIDI bytes taken from the OUT packets, when looping back */
+static void *emu_midi_thread(void *arg)
+{
+	struct emu *emu = arg;
+	uint8_t buf[MIDI_IN_PACKET_SIZE];
+	ssize_t len;
+	int ret;
+
+	while (!stop) {
+		len = read(emu->midi_pipe[0], buf, sizeof(buf));
+		if (len <= 0)
+			break;
+
+		ret = emu_ep_io(emu, USB_RAW_IOCTL_EP_WRITE, emu->ep_midi, buf, len);
+		if (ret < 0) {
+			if (errno != ESHUTDOWN)
+				perror("EP 3 write");
+			break;
+		}
+		emu->midi_in += len;
+	}
+
+	return NULL;
+}
+
+static const struct usb_device_descriptor device_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bDeviceClass = USB_CLASS_VENDOR_SPEC,
+	.bMaxPacketSize0 = 64,
+	.idVendor = EMU_VENDOR_ID,
+	.idProduct = EMU_PRODUCT_ID,
+	.bcdDevice = 0x0100,
+	.iManufacturer = 1,
+	.iProduct = 2,
+	.bNumConfigurations = 1
+};
+
+/* two interfaces with the endpoints on alternate setting 1, like the mixer */
+static int emu_config_desc(struct emu *emu, uint8_t *buf)
+{
+	struct usb_config_descriptor config = {
+		.bLength = USB_DT_CONFIG_SIZE,
+		.bDescriptorType = USB_DT_CONFIG,
+		.bNumInterfaces = 2,
+		.bConfigurationValue = 1,
+		.bmAttributes = USB_CONFIG_ATT_ONE | USB_CONFIG_ATT_SELFPOWER,
+		.bMaxPower = 0
+	};
+	struct usb_interface_descriptor intf = {
+		.bLength = USB_DT_INTERFACE_SIZE,
+		.bDescriptorType = USB_DT_INTERFACE,
+		.bInterfaceClass = USB_CLASS_VENDOR_SPEC
+	};
+	struct usb_endpoint_descriptor ep = {
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT
+	};
+	uint8_t xfer = emu->opt.bulk ? USB_ENDPOINT_XFER_BULK : USB_ENDPOINT_XFER_INT;
+	uint16_t maxpacket = emu->opt.bulk ? 512 : 1024;
+	uint8_t interval = emu->opt.bulk ? 0 : 1;
+	unsigned int len = USB_DT_CONFIG_SIZE;
+
+#define ADD(desc, size) do { memcpy(buf + len, &(desc), size); len += size; } while (0)
+	intf.bInterfaceNumber = 0;
+	intf.bAlternateSetting = 0;
+	intf.bNumEndpoints = 0;
+	ADD(intf, USB_DT_INTERFACE_SIZE);
+	intf.bAlternateSetting = 1;
+	intf.bNumEndpoints = 2;
+	ADD(intf, USB_DT_INTERFACE_SIZE);
+	ep.bEndpointAddress = EMU_PCM_OUT_EP;
+	ep.bmAttributes = xfer;
+	ep.wMaxPacketSize = htole16(maxpacket);
+	ep.bInterval = interval;
+	ADD(ep, USB_DT_ENDPOINT_SIZE);
+	ep.bEndpointAddress = EMU_PCM_IN_EP;
+	ADD(ep, USB_DT_ENDPOINT_SIZE);
+
+	intf.bInterfaceNumber = 1;
+	intf.bAlternateSetting = 0;
+	intf.bNumEndpoints = 0;
+	ADD(intf, USB_DT_INTERFACE_SIZE);
+	intf.bAlternateSetting = 1;
+	intf.bNumEndpoints = 1;
+	ADD(intf, USB_DT_INTERFACE_SIZE);
+	ep.bEndpointAddress = EMU_MIDI_IN_EP;
+	ep.bmAttributes = USB_ENDPOINT_XFER_BULK;
+	ep.wMaxPacketSize = htole16(512);
+	ep.bInterval = 0;
+	ADD(ep, USB_DT_ENDPOINT_SIZE);
+#undef ADD
+
+	config.wTotalLength = htole16(len);
+	memcpy(buf, &config, USB_DT_CONFIG_SIZE);
+	return len;
+}
+
+static int emu_string_desc(unsigned int index, uint8_t *buf)
+{
+	static const char * const strings[] = { NULL, "Allen&Heath", "XONE:DB4 (emulated)" };
+	const char *s;
+	unsigned int i;
+
+	if (index == 0) {
+		buf[0] = 4;
+		buf[1] = USB_DT_STRING;
+		buf[2] = 0x09; /* en-US */
+		buf[3] = 0x04;
+		return 4;
+	}
+	if (index >= sizeof(strings) / sizeof(strings[0]))
+		return -1;
+
+	s = strings[index];
+	for (i = 0; s[i]; i++) {
+		buf[2 + i * 2] = s[i];
+		buf[3 + i * 2] = 0;
+	}
+	buf[0] = 2 + i * 2;
+	buf[1] = USB_DT_STRING;
+	return buf[0];
+}
+
+static int emu_ep_enable(struct emu *emu, uint8_t addr, uint8_t xfer, uint16_t maxpacket, uint8_t interval)
+{
+	struct usb_endpoint_descriptor ep = {
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = addr,
+		.bmAttributes = xfer,
+		.wMaxPacketSize = htole16(maxpacket),
+		.bInterval = interval
+	};
+	int ret;
+
+	ret = ioctl(emu->fd, USB_RAW_IOCTL_EP_ENABLE, &ep);
+	if (ret < 0)
+		fprintf(stderr, "EP 0x%02x: enable failed: %s\n", addr, strerror(errno));
+	return ret;
+}
+
+/* alternate setting 1 of interface 0 starts the audio */
+static int emu_start_streaming(struct emu *emu)
+{
+	uint8_t xfer = emu->opt.bulk ? USB_ENDPOINT_XFER_BULK : USB_ENDPOINT_XFER_INT;
+	uint16_t maxpacket = emu->opt.bulk ? 512 : 1024;
+	uint8_t interval = emu->opt.bulk ? 0 : 1;
+
+	if (emu->streaming)
+		return 0;
+
+	emu->ep_out = emu_ep_enable(emu, EMU_PCM_OUT_EP, xfer, maxpacket, interval);
+	emu->ep_in = emu_ep_enable(emu, EMU_PCM_IN_EP, xfer, maxpacket, interval);
+	emu->ep_midi = emu_ep_enable(emu, EMU_MIDI_IN_EP, USB_ENDPOINT_XFER_BULK, 512, 0);
+	if (emu->ep_out < 0 || emu->ep_in < 0 || emu->ep_midi < 0)
+		return -1;
+
+	emu_fifo_reset(&emu->fifo, emu->opt.latency);
+	pthread_create(&emu->out_thread, NULL, emu_out_thread, emu);
+	pthread_create(&emu->in_thread, NULL, emu_in_thread, emu);
+	pthread_create(&emu->midi_thread, NULL, emu_midi_thread, emu);
+	emu->streaming = true;
+
+	return 0;
+}
+
+static void emu_set_rate(struct emu *emu, const uint8_t *bytes)
+{
+	unsigned int rate = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16);
+	unsigned int i;
+	int64_t lock_at;
+
+	for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+		if (rates[i] == rate)
+			break;
+	}
+	if (i == sizeof(rates) / sizeof(rates[0])) {
+		fprintf(stderr, "ignoring unsupported rate %u\n", rate);
+		return;
+	}
+
+	pthread_mutex_lock(&emu->lock);
+	if (emu->rate != rate) {
+		emu->rate = rate;
+		lock_at = emu_now() + emu->opt.lock_ms * 1000000LL;
+		emu->lock_at = emu_ns_ts(lock_at);
+	}
+	pthread_mutex_unlock(&emu->lock);
+
+	if (emu->opt.verbose)
+		printf("rate %u Hz\n", rate);
+}
+
+static uint8_t emu_status(struct emu *emu)
+{
+	uint8_t status = STATUS_STREAMING;
+
+	pthread_mutex_lock(&emu->lock);
+	if (emu_now() >= emu_ts_ns(&emu->lock_at))
+		status |= STATUS_STABLE | STATUS_CLOCK_LOCK;
+	pthread_mutex_unlock(&emu->lock);
+
+	return status;
+}
+
+/* fills data for IN requests, returns its length or -1 to stall */
+static int emu_control(struct emu *emu, const struct usb_ctrlrequest *ctrl, uint8_t *data, bool *set_rate)
+{
+	unsigned int type = ctrl->bRequestType & USB_TYPE_MASK;
+	unsigned int i;
+
+	if (type == USB_TYPE_STANDARD) {
+		switch (ctrl->bRequest) {
+		case USB_REQ_GET_DESCRIPTOR:
+			switch (ctrl->wValue >> 8) {
+			case USB_DT_DEVICE:
+				memcpy(data, &device_desc, sizeof(device_desc));
+				return sizeof(device_desc);
+			case USB_DT_CONFIG:
+				return emu_config_desc(emu, data);
+			case USB_DT_STRING:
+				return emu_string_desc(ctrl->wValue & 0xff, data);
+			default:
+				return -1;
+			}
+		case USB_REQ_SET_CONFIGURATION:
+			if (!emu->configured) {
+				if (ioctl(emu->fd, USB_RAW_IOCTL_VBUS_DRAW, 0) < 0 || ioctl(emu->fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0)
+					return -1;
+				emu->configured = true;
+			}
+			return 0;
+		case USB_REQ_SET_INTERFACE:
+			if (ctrl->wIndex == 0 && ctrl->wValue == 1)
+				return emu_start_streaming(emu) < 0 ? -1 : 0;
+			return 0;
+		case USB_REQ_GET_INTERFACE:
+			data[0] = emu->streaming;
+			return 1;
+		case USB_REQ_GET_STATUS:
+			data[0] = 0;
+			data[1] = 0;
+			return 2;
+		case USB_REQ_CLEAR_FEATURE:
+			/* xonedb4_send_resets() and the host's halt recovery */
+			if ((ctrl->bRequestType & USB_RECIP_MASK) == USB_RECIP_ENDPOINT && emu->streaming) {
+				i = ctrl->wIndex == EMU_PCM_OUT_EP ? emu->ep_out : ctrl->wIndex == EMU_PCM_IN_EP ? emu->ep_in : emu->ep_midi;
+				ioctl(emu->fd, USB_RAW_IOCTL_EP_CLEAR_HALT, i);
+			}
+			return 0;
+		default:
+			return -1;
+		}
+	}
+
+	switch (ctrl->bRequest) {
+	case 0x56: /* firmware version */
+		memset(data, 0, 15);
+		data[2] = emu->opt.firmware;
+		return 15;
+	case 0x49:
+		if (ctrl->bRequestType & USB_DIR_IN) {
+			data[0] = emu_status(emu);
+			return 1;
+		}
+		return 0; /* the host is done probing */
+	case 0x81: /* current samplerate */
+		pthread_mutex_lock(&emu->lock);
+		data[0] = emu->rate;
+		data[1] = emu->rate >> 8;
+		data[2] = emu->rate >> 16;
+		pthread_mutex_unlock(&emu->lock);
+		return 3;
+	case 0x01: /* set samplerate, once per streaming endpoint */
+		*set_rate = true;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static void emu_ep0(struct emu *emu, const struct usb_ctrlrequest *ctrl)
+{
+	struct {
+		struct usb_raw_ep_io io;
+		uint8_t data[EP0_MAX_DATA];
+	} buf;
+	bool set_rate = false;
+	int len;
+
+	memset(&buf, 0, sizeof(buf));
+	len = emu_control(emu, ctrl, buf.data, &set_rate);
+
+	if (emu->opt.verbose)
+		printf("ctrl %02x %02x %04x %04x %u -> %d\n", ctrl->bRequestType, ctrl->bRequest, ctrl->wValue, ctrl->wIndex, ctrl->wLength, len);
+
+	if (len < 0) {
+		ioctl(emu->fd, USB_RAW_IOCTL_EP0_STALL, 0);
+		return;
+	}
+
+	if (ctrl->bRequestType & USB_DIR_IN) {
+		buf.io.length = len < ctrl->wLength ? len : ctrl->wLength;
+		if (ioctl(emu->fd, USB_RAW_IOCTL_EP0_WRITE, &buf.io) < 0)
+			perror("EP0_WRITE");
+		return;
+	}
+
+	/* also acks requests without a data stage */
+	buf.io.length = ctrl->wLength < EP0_MAX_DATA ? ctrl->wLength : EP0_MAX_DATA;
+	if (ioctl(emu->fd, USB_RAW_IOCTL_EP0_READ, &buf.io) < 0) {
+		perror("EP0_READ");
+		return;
+	}
+
+	if (set_rate && buf.io.length >= 3)
+		emu_set_rate(emu, buf.data);
+}
+
+static void emu_report(struct emu *emu)
+{
+	fprintf(stderr, "EP 5: %lu packets, %lu late, %lu injected errors, %lu MIDI bytes\n",
+		emu->out.packets, emu->out.late, emu->out.injected, emu->midi_out);
+	fprintf(stderr, "EP 6: %lu packets, %lu late, %lu injected errors\n",
+		emu->in.packets, emu->in.late, emu->in.injected);
+	fprintf(stderr, "EP 3: %lu MIDI bytes\n", emu->midi_in);
+	if (emu->opt.loopback)
+		fprintf(stderr, "loopback: %lu underruns, %lu overruns\n", emu->fifo.underruns, emu->fifo.overruns);
+}
+
+static void emu_usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -d DRIVER    UDC driver (dummy_udc)\n"
+		"  -D DEVICE    UDC device (dummy_udc.0)\n"
+		"  -m MODE      bulk or int transfers on EP 5/6 (bulk)\n"
+		"  -r RATE      initial samplerate (48000)\n"
+		"  -f VERSION   firmware version byte (44, reported as 1.4.4)\n"
+		"  -k MS        clock lock time after a rate change (0)\n"
+		"  -L           loop EP 5 audio to EP 6 and MIDI OUT to EP 3\n"
+		"  -l FRAMES    loopback latency (0)\n"
+		"  -j US        completion jitter (0)\n"
+		"  -e N         fail one in N transfers (off)\n"
+		"  -E KIND      failure: drop, stall or short (drop)\n"
+		"  -v           log control requests\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	static struct emu emu = {
+		.opt = {
+			.driver = "dummy_udc",
+			.device = "dummy_udc.0",
+			.bulk = true,
+			.rate = 48000,
+			.firmware = 44
+		},
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.fifo.lock = PTHREAD_MUTEX_INITIALIZER
+	};
+	struct usb_raw_init init;
+	struct {
+		struct usb_raw_event event;
+		uint8_t data[sizeof(struct usb_ctrlrequest)];
+	} ev;
+	struct sigaction sa = { .sa_handler = emu_on_signal };
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:D:m:r:f:k:Ll:j:e:E:v")) != -1) {
+		switch (opt) {
+		case 'd':
+			emu.opt.driver = optarg;
+			break;
+		case 'D':
+			emu.opt.device = optarg;
+			break;
+		case 'm':
+			emu.opt.bulk = strcmp(optarg, "int") != 0;
+			break;
+		case 'r':
+			emu.opt.rate = atoi(optarg);
+			break;
+		case 'f':
+			emu.opt.firmware = atoi(optarg);
+			break;
+		case 'k':
+			emu.opt.lock_ms = atoi(optarg);
+			break;
+		case 'L':
+			emu.opt.loopback = true;
+			break;
+		case 'l':
+			emu.opt.latency = atoi(optarg);
+			break;
+		case 'j':
+			emu.opt.jitter_us = atoi(optarg);
+			break;
+		case 'e':
+			emu.opt.error_rate = atoi(optarg);
+			break;
+		case 'E':
+			if (!strcmp(optarg, "stall"))
+				emu.opt.error_kind = INJECT_STALL;
+			else if (!strcmp(optarg, "short"))
+				emu.opt.error_kind = INJECT_SHORT;
+			else
+				emu.opt.error_kind = INJECT_DROP;
+			break;
+		case 'v':
+			emu.opt.verbose = true;
+			break;
+		default:
+			emu_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (emu.opt.latency >= FIFO_FRAMES) {
+		fprintf(stderr, "latency must stay below %u frames\n", FIFO_FRAMES);
+		return 1;
+	}
+
+	emu.rate = emu.opt.rate;
+	emu.fifo.frames = calloc(FIFO_FRAMES, BYTES_PER_FRAME);
+	if (!emu.fifo.frames || pipe(emu.midi_pipe) < 0) {
+		perror("setup");
+		return 1;
+	}
+	srandom(time(NULL));
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	emu.fd = open("/dev/raw-gadget", O_RDWR);
+	if (emu.fd < 0) {
+		perror("/dev/raw-gadget");
+		return 1;
+	}
+
+	memset(&init, 0, sizeof(init));
+	strncpy((char *) init.driver_name, emu.opt.driver, UDC_NAME_LENGTH_MAX - 1);
+	strncpy((char *) init.device_name, emu.opt.device, UDC_NAME_LENGTH_MAX - 1);
+	init.speed = USB_SPEED_HIGH;
+	if (ioctl(emu.fd, USB_RAW_IOCTL_INIT, &init) < 0 || ioctl(emu.fd, USB_RAW_IOCTL_RUN, 0) < 0) {
+		perror("raw-gadget");
+		return 1;
+	}
+
+	while (!stop) {
+		ev.event.type = 0;
+		ev.event.length = sizeof(ev.data);
+		if (ioctl(emu.fd, USB_RAW_IOCTL_EVENT_FETCH, &ev.event) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("EVENT_FETCH");
+			break;
+		}
+
+		switch (ev.event.type) {
+		case USB_RAW_EVENT_CONNECT:
+			if (emu.opt.verbose)
+				printf("connected\n");
+			break;
+		case USB_RAW_EVENT_CONTROL:
+			emu_ep0(&emu, (struct usb_ctrlrequest *) ev.data);
+			break;
+		default:
+			/* reset, disconnect, suspend or resume */
+			break;
+		}
+	}
+
+	stop = 1;
+	close(emu.midi_pipe[1]);
+	emu_report(&emu);
+	close(emu.fd);
+
+	return 0;
+}
@@ -0,0 +1,443 @@
+/*
+ * Round-trip latency and jitter of snd-usb-xonedb4. Plays a maximum length
+ * sequence (or an impulse) on one output channel and looks for it on an
+ * input channel that is looped back, either with a cable or by running
+ * xonedb4-emu with -L:
+ *
+ *   ./xonedb4-latency -D hw:DB4 -o 0 -i 0 -p 160,320,640 -n 2,3
+ *
+ * Playback and capture are linked, so frame n of both streams starts at
+ * the same time. The capture window starts at the frame index the stimulus
+ * was written at, so the prefilled playback buffer cancels out and the lag
+ * of the correlation peak is only the URB, device and loop latency ("loop").
+ * A client hears its writes one buffer (period * periods frames) later on
+ * top of that, so "frames" and "us" add the buffer to the loop latency.
+ * Every period size / period count pair gets its own row; -t labels the rows, e.g. with the transfer mode
+ * the device or emulator runs in. Both streams use the same period size,
+ * which the driver wants in whole OUT (40 frames) and IN (32 frames)
+ * packets, so periods are multiples of 160 frames.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <alsa/asoundlib.h>
+
+#define N_CHANNELS				8
+#define BYTES_PER_SAMPLE		3 /* S24_3LE, the only format of the driver */
+#define BYTES_PER_FRAME			(N_CHANNELS * BYTES_PER_SAMPLE)
+
+#define MLS_ORDER				12
+#define MLS_LENGTH				((1 << MLS_ORDER) - 1)
+#define MLS_TAPS				0x0829 /* x^12 + x^6 + x^4 + x + 1, Galois form */
+#define SIGNAL_LEVEL			0x200000 /* -12 dBFS */
+#define MIN_CORRELATION			0.25 /* of the peak a loop at unity gain gives */
+
+#define MAX_SETTINGS			16
+#define MAX_RESTARTS			10 /* xruns tolerated per setting */
+
+struct options {
+	const char *playback;
+	const char *capture;
+	unsigned int rate;
+	unsigned int out_channel;
+	unsigned int in_channel;
+	unsigned int periods[MAX_SETTINGS];
+	unsigned int n_periods;
+	unsigned int counts[MAX_SETTINGS];
+	unsigned int n_counts;
+	unsigned int runs; /* measurements per setting */
+	unsigned int max_latency; /* frames searched after the stimulus */
+	const char *tag;
+	bool impulse;
+	bool verbose;
+};
+
+struct result {
+	unsigned int detected;
+	unsigned int xruns;
+	double mean; /* frames */
+	double stddev;
+	long min;
+	long max;
+};
+
+static int signal_at(const struct options *opt, const int8_t *mls, long k)
+{
+	if (opt->impulse)
+		return k == 0 ? SIGNAL_LEVEL : 0;
+	if (k < 0 || k >= MLS_LENGTH)
+		return 0;
+	return mls[k] * SIGNAL_LEVEL;
+}
+
+static unsigned int signal_length(const struct options *opt)
+{
+	return opt->impulse ? 1 : MLS_LENGTH;
+}
+
+static void mls_generate(int8_t *mls)
+{
+	unsigned int reg = 1;
+	unsigned int i;
+
+	for (i = 0; i < MLS_LENGTH; i++) {
+		mls[i] = reg & 1 ? 1 : -1;
+		reg = (reg >> 1) ^ (reg & 1 ? MLS_TAPS : 0);
+	}
+}
+
+static void put_sample(uint8_t *frame, unsigned int channel, int value)
+{
+	uint8_t *p = frame + channel * BYTES_PER_SAMPLE;
+
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+}
+
+static int get_sample(const uint8_t *frame, unsigned int channel)
+{
+	const uint8_t *p = frame + channel * BYTES_PER_SAMPLE;
+	int value = p[0] | (p[1] << 8) | (p[2] << 16);
+
+	return value & 0x800000 ? value - 0x1000000 : value;
+}
+
+static int set_params(snd_pcm_t *pcm, const struct options *opt, snd_pcm_uframes_t period, unsigned int periods)
+{
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	snd_pcm_uframes_t buffer = period * periods;
+	unsigned int rate = opt->rate;
+	int ret;
+
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_sw_params_alloca(&sw);
+
+	if ((ret = snd_pcm_hw_params_any(pcm, hw)) < 0 ||
+	    (ret = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0 ||
+	    (ret = snd_pcm_hw_params_set_format(pcm, hw, SND_PCM_FORMAT_S24_3LE)) < 0 ||
+	    (ret = snd_pcm_hw_params_set_channels(pcm, hw, N_CHANNELS)) < 0 ||
+	    (ret = snd_pcm_hw_params_set_rate(pcm, hw, rate, 0)) < 0 ||
+	    (ret = snd_pcm_hw_params_set_period_size(pcm, hw, period, 0)) < 0 ||
+	    (ret = snd_pcm_hw_params_set_buffer_size(pcm, hw, buffer)) < 0 ||
+	    (ret = snd_pcm_hw_params(pcm, hw)) < 0)
+		return ret;
+
+	if ((ret = snd_pcm_sw_params_current(pcm, sw)) < 0 ||
+	    (ret = snd_pcm_sw_params_set_start_threshold(pcm, sw, 0x7fffffff)) < 0 ||
+	    (ret = snd_pcm_sw_params_set_avail_min(pcm, sw, period)) < 0 ||
+	    (ret = snd_pcm_sw_params(pcm, sw)) < 0)
+		return ret;
+
+	return 0;
+}
+
+/* lag of the stimulus in a captured window, -1 if it is not in there */
+static long find_lag(const struct options *opt, const int8_t *mls, const int *window, unsigned int len)
+{
+	unsigned int n = signal_length(opt);
+	double best = 0, sum;
+	long lag = -1;
+	unsigned int i, k;
+
+	for (i = 0; i + n <= len; i++) {
+		sum = 0;
+		for (k = 0; k < n; k++)
+			sum += (double) window[i + k] * signal_at(opt, mls, k);
+		if (sum > best) {
+			best = sum;
+			lag = i;
+		}
+	}
+
+	/* a loop at unity gain gives n * level^2 */
+	if (best < MIN_CORRELATION * n * (double) SIGNAL_LEVEL * SIGNAL_LEVEL)
+		return -1;
+	return lag;
+}
+
+static int recover(snd_pcm_t *pcm, int err, struct result *res)
+{
+	if (err == -EPIPE || err == -ESTRPIPE)
+		res->xruns++;
+	return snd_pcm_recover(pcm, err, 1);
+}
+
+/*
+ * Streams silence with a stimulus every window, keeps what comes back
+ * from the frame the stimulus went out on, then correlates offline so the
+ * analysis can't cause xruns of its own. Returns 1 if an xrun broke the
+ * alignment of the streams and the setting has to start over.
+ */
+static int measure(snd_pcm_t *play, snd_pcm_t *cap, const struct options *opt, const int8_t *mls,
+		   snd_pcm_uframes_t period, struct result *res)
+{
+	unsigned int window = signal_length(opt) + opt->max_latency;
+	uint8_t *out = calloc(period, BYTES_PER_FRAME);
+	uint8_t *in = calloc(period, BYTES_PER_FRAME);
+	int *captured = calloc((size_t) opt->runs * window, sizeof(int));
+	long written = 0, read = 0;
+	long stimulus;
+	unsigned int run = 0;
+	unsigned int i;
+	double sum = 0, sum2 = 0;
+	long lag;
+	snd_pcm_sframes_t ret;
+	int err = 0;
+
+	if (!out || !in || !captured) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* fill the playback buffer, capture starts with it */
+	while (snd_pcm_avail(play) >= (snd_pcm_sframes_t) period) {
+		ret = snd_pcm_writei(play, out, period);
+		if (ret < 0) {
+			err = ret;
+			goto out;
+		}
+		written += ret;
+	}
+	stimulus = written;
+	if ((err = snd_pcm_start(cap)) < 0)
+		goto out;
+
+	while (run < opt->runs) {
+		memset(out, 0, period * BYTES_PER_FRAME);
+		for (i = 0; i < period; i++)
+			put_sample(out + i * BYTES_PER_FRAME, opt->out_channel, signal_at(opt, mls, written + i - stimulus));
+
+		ret = snd_pcm_writei(play, out, period);
+		if (ret < 0) {
+			err = recover(play, ret, res);
+			if (!err)
+				err = 1;
+			goto out;
+		}
+		written += ret;
+
+		ret = snd_pcm_readi(cap, in, period);
+		if (ret < 0) {
+			err = recover(cap, ret, res);
+			if (!err)
+				err = 1;
+			goto out;
+		}
+
+		for (i = 0; i < ret; i++) {
+			long pos = read + i - stimulus;
+
+			if (pos >= 0 && pos < window)
+				captured[run * window + pos] = get_sample(in + i * BYTES_PER_FRAME, opt->in_channel);
+		}
+		read += ret;
+
+		if (read - stimulus >= window) {
+			run++;
+			stimulus = written;
+		}
+	}
+
+	snd_pcm_drop(play);
+
+	for (run = 0; run < opt->runs; run++) {
+		lag = find_lag(opt, mls, captured + run * window, window);
+		if (opt->verbose)
+			printf("  run %u: %ld\n", run, lag);
+		if (lag < 0)
+			continue;
+
+		res->detected++;
+		sum += lag;
+		sum2 += (double) lag * lag;
+		if (res->min < 0 || lag < res->min)
+			res->min = lag;
+		if (lag > res->max)
+			res->max = lag;
+	}
+
+	if (res->detected) {
+		res->mean = sum / res->detected;
+		res->stddev = sqrt(fmax(0, sum2 / res->detected - res->mean * res->mean));
+	}
+
+out:
+	free(out);
+	free(in);
+	free(captured);
+	return err;
+}
+
+static int run_setting(const struct options *opt, const int8_t *mls, unsigned int period, unsigned int periods)
+{
+	snd_pcm_t *play = NULL, *cap = NULL;
+	struct result res;
+	double us = 1000000.0 / opt->rate;
+	double buffer = (double) period * periods;
+	int err;
+
+	if ((err = snd_pcm_open(&play, opt->playback, SND_PCM_STREAM_PLAYBACK, 0)) < 0 ||
+	    (err = snd_pcm_open(&cap, opt->capture, SND_PCM_STREAM_CAPTURE, 0)) < 0 ||
+	    (err = set_params(play, opt, period, periods)) < 0 ||
+	    (err = set_params(cap, opt, period, periods)) < 0 ||
+	    (err = snd_pcm_link(play, cap)) < 0 ||
+	    (err = snd_pcm_prepare(play)) < 0) {
+		fprintf(stderr, "%u x %u: %s\n", period, periods, snd_strerror(err));
+		goto out;
+	}
+
+	memset(&res, 0, sizeof(res));
+	res.min = -1;
+	do {
+		/* linked, so this stops and prepares both streams */
+		snd_pcm_drop(play);
+		snd_pcm_prepare(play);
+		err = measure(play, cap, opt, mls, period, &res);
+	} while (err > 0 && res.xruns <= MAX_RESTARTS);
+	if (err > 0)
+		err = -EPIPE;
+	if (err < 0) {
+		fprintf(stderr, "%u x %u: %s\n", period, periods, snd_strerror(err));
+		goto out;
+	}
+
+	if (!res.detected) {
+		printf("%-8s %6u %3u %6u   not detected %9s %8s %8s %8s %5u\n", opt->tag, period, periods, opt->rate, "", "", "", "", res.xruns);
+		goto out;
+	}
+
+	printf("%-8s %6u %3u %6u %8.1f %9.1f %8.1f %8.2f %8.2f %5u\n", opt->tag, period, periods, opt->rate,
+	       buffer + res.mean, (buffer + res.mean) * us, res.mean, res.stddev, res.stddev * us, res.xruns);
+	if (res.max != res.min)
+		printf("%-8s   loop spread %ld..%ld frames over %u of %u runs\n", "", res.min, res.max, res.detected, opt->runs);
+
+out:
+	if (play)
+		snd_pcm_close(play);
+	if (cap)
+		snd_pcm_close(cap);
+	return err;
+}
+
+static unsigned int parse_list(const char *arg, unsigned int *list)
+{
+	unsigned int n = 0;
+	char *end;
+
+	while (*arg && n < MAX_SETTINGS) {
+		list[n++] = strtoul(arg, &end, 0);
+		if (*end != ',')
+			break;
+		arg = end + 1;
+	}
+	return n;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -D PCM       playback device (hw:0)\n"
+		"  -C PCM       capture device (same as -D)\n"
+		"  -r RATE      samplerate (48000)\n"
+		"  -o CH        output channel, from 0 (0)\n"
+		"  -i CH        input channel, from 0 (0)\n"
+		"  -p SIZES     period sizes in frames (160,320,640,1280)\n"
+		"  -n COUNTS    periods per buffer (2)\n"
+		"  -m RUNS      measurements per setting (10)\n"
+		"  -w FRAMES    latency searched for (rate / 4)\n"
+		"  -I           impulse instead of MLS\n"
+		"  -t TAG       label of the rows, e.g. bulk or int\n"
+		"  -v           print every measurement\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	struct options opt = {
+		.playback = "hw:0",
+		.rate = 48000,
+		.periods = { 160, 320, 640, 1280 },
+		.n_periods = 4,
+		.counts = { 2 },
+		.n_counts = 1,
+		.runs = 10,
+		.tag = "-"
+	};
+	int8_t mls[MLS_LENGTH];
+	unsigned int p, c;
+	int failed = 0;
+	int o;
+
+	while ((o = getopt(argc, argv, "D:C:r:o:i:p:n:m:w:It:v")) != -1) {
+		switch (o) {
+		case 'D':
+			opt.playback = optarg;
+			break;
+		case 'C':
+			opt.capture = optarg;
+			break;
+		case 'r':
+			opt.rate = atoi(optarg);
+			break;
+		case 'o':
+			opt.out_channel = atoi(optarg);
+			break;
+		case 'i':
+			opt.in_channel = atoi(optarg);
+			break;
+		case 'p':
+			opt.n_periods = parse_list(optarg, opt.periods);
+			break;
+		case 'n':
+			opt.n_counts = parse_list(optarg, opt.counts);
+			break;
+		case 'm':
+			opt.runs = atoi(optarg);
+			break;
+		case 'w':
+			opt.max_latency = atoi(optarg);
+			break;
+		case 'I':
+			opt.impulse = true;
+			break;
+		case 't':
+			opt.tag = optarg;
+			break;
+		case 'v':
+			opt.verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!opt.capture)
+		opt.capture = opt.playback;
+	if (!opt.max_latency)
+		opt.max_latency = opt.rate / 4;
+	if (opt.out_channel >= N_CHANNELS || opt.in_channel >= N_CHANNELS || !opt.runs || !opt.rate) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	mls_generate(mls);
+
+	printf("%-8s %6s %3s %6s %8s %9s %8s %8s %8s %5s\n", "tag", "period", "n", "rate", "frames", "us", "loop", "sd fr", "sd us", "xruns");
+	for (p = 0; p < opt.n_periods; p++) {
+		for (c = 0; c < opt.n_counts; c++) {
+			if (run_setting(&opt, mls, opt.periods[p], opt.counts[c]) < 0)
+				failed = 1;
+		}
+	}
+
+	return failed;
+}
@@ -0,0 +1,3 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#define CREATE_TRACE_POINTS
+#include "trace.h"
@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM xonedb4
+
+#if !defined(XONEDB4_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define XONEDB4_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(xonedb4_pcm_urb,
+	TP_PROTO(int card, int index, int status, unsigned int dma_off, unsigned int frames),
+	TP_ARGS(card, index, status, dma_off, frames),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(int, index)
+		__field(int, status)
+		__field(unsigned int, dma_off)
+		__field(unsigned int, frames)
+	),
+	TP_fast_assign(
+		__entry->card = card;
+		__entry->index = index;
+		__entry->status = status;
+		__entry->dma_off = dma_off;
+		__entry->frames = frames;
+	),
+	TP_printk("card=%d urb=%d status=%d dma_off=%u frames=%u", __entry->card, __entry->index, __entry->status, __entry->dma_off, __entry->frames)
+);
+
+/* dma_off is the byte offset the packet was converted at */
+DEFINE_EVENT(xonedb4_pcm_urb, xonedb4_pcm_in_urb,
+	TP_PROTO(int card, int index, int status, unsigned int dma_off, unsigned int frames),
+	TP_ARGS(card, index, status, dma_off, frames)
+);
+
+DEFINE_EVENT(xonedb4_pcm_urb, xonedb4_pcm_out_urb,
+	TP_PROTO(int card, int index, int status, unsigned int dma_off, unsigned int frames),
+	TP_ARGS(card, index, status, dma_off, frames)
+);
+
+TRACE_EVENT(xonedb4_pcm_trigger,
+	TP_PROTO(int card, int stream, int cmd),
+	TP_ARGS(card, stream, cmd),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(int, stream)
+		__field(int, cmd)
+	),
+	TP_fast_assign(
+		__entry->card = card;
+		__entry->stream = stream;
+		__entry->cmd = cmd;
+	),
+	TP_printk("card=%d stream=%d cmd=%d", __entry->card, __entry->stream, __entry->cmd)
+);
+
+TRACE_EVENT(xonedb4_pcm_pointer,
+	TP_PROTO(int card, int stream, unsigned int dma_off),
+	TP_ARGS(card, stream, dma_off),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(int, stream)
+		__field(unsigned int, dma_off)
+	),
+	TP_fast_assign(
+		__entry->card = card;
+		__entry->stream = stream;
+		__entry->dma_off = dma_off;
+	),
+	TP_printk("card=%d stream=%d dma_off=%u", __entry->card, __entry->stream, __entry->dma_off)
+);
+
+TRACE_EVENT(xonedb4_midi_out_trigger,
+	TP_PROTO(int card, int up, unsigned int queued),
+	TP_ARGS(card, up, queued),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(int, up)
+		__field(unsigned int, queued)
+	),
+	TP_fast_assign(
+		__entry->card = card;
+		__entry->up = up;
+		__entry->queued = queued;
+	),
+	TP_printk("card=%d up=%d queued=%u", __entry->card, __entry->up, __entry->queued)
+);
+
+TRACE_EVENT(xonedb4_midi_in_urb,
+	TP_PROTO(int card, int index, int status, unsigned int bytes),
+	TP_ARGS(card, index, status, bytes),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(int, index)
+		__field(int, status)
+		__field(unsigned int, bytes)
+	),
+	TP_fast_assign(
+		__entry->card = card;
+		__entry->index = index;
+		__entry->status = status;
+		__entry->bytes = bytes;
+	),
+	TP_printk("card=%d urb=%d status=%d bytes=%u", __entry->card, __entry->index, __entry->status, __entry->bytes)
+);
+
+#endif /* XONEDB4_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>